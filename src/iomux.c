@@ -5,9 +5,14 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -20,11 +25,18 @@
 #include <sys/socket.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <stdarg.h>
 
 #include <sys/resource.h>
+#include <sys/ioctl.h>
+
+#if defined(__linux__)
+#include <linux/sockios.h>
+#include <sys/eventfd.h>
+#endif
 
 #if defined(HAVE_EPOLL)
 #include <sys/epoll.h>
@@ -32,7 +44,9 @@
 #include <sys/event.h>
 #endif
 
+#ifndef __USE_UNIX98
 #define __USE_UNIX98
+#endif
 #include <pthread.h>
 
 #include "bsd_queue.h"
@@ -44,15 +58,61 @@
 // 1MB default connection bufsize
 #define IOMUX_CONNECTION_BUFSIZE_DEFAULT (1<<13) // defaults to 8192
 #define IOMUX_CONNECTION_SERVER (1)
+#define IOMUX_CONNECTION_CORKED (1<<1)
+#define IOMUX_CONNECTION_NOTSOCK (1<<2)
+#define IOMUX_CONNECTION_OUTPUT_FULL (1<<3)
+#define IOMUX_CONNECTION_INPUT_PAUSED (1<<4)
+#define IOMUX_CONNECTION_INPUT_FULL (1<<5)
+#define IOMUX_CONNECTION_INPUT_BLOCKED (IOMUX_CONNECTION_INPUT_PAUSED|IOMUX_CONNECTION_INPUT_FULL)
+#define IOMUX_CONNECTION_OUTPUT_WANTED (1<<6)
+#define IOMUX_CONNECTION_EXCLUSIVE (1<<7)
+// the connection is being dispatched by a thread running a oneshot mux
+// (see iomux_set_oneshot()), closing/removing it from other threads is deferred
+#define IOMUX_CONNECTION_BUSY (1<<8)
+#define IOMUX_CONNECTION_CLOSE_PENDING (1<<9)
+#define IOMUX_CONNECTION_REMOVE_PENDING (1<<10)
+// maximum number of chunks written with a single syscall
+#define IOMUX_WRITEV_MAX (64)
+// size of the per-mux buffer used to read more than bufsize bytes per syscall
+#define IOMUX_READ_OVERFLOW_DEFAULT (1<<16) // defaults to 65536
+// COPY mode payloads are stored in the chunk itself, chunks sized for
+// payloads up to this size are the common case and are the ones cached
+#define IOMUX_CHUNK_INLINE_SIZE (256)
+// maximum number of released chunks kept around for reuse
+#define IOMUX_CHUNK_CACHE_MAX (1<<12)
 
 #define MUTEX_LOCK(_iom) if (_iom->lock && __builtin_expect(pthread_mutex_lock((_iom->lock)) != 0, 0)) { abort(); }
 #define MUTEX_UNLOCK(_iom) if (_iom->lock && __builtin_expect(pthread_mutex_unlock((_iom->lock)) != 0, 0)) { abort(); }
+#define MUTEX_TRYLOCK(_iom) (!_iom->lock || pthread_mutex_trylock(_iom->lock) == 0)
+
+// NOTE - the timers have their own lock so that they can be scheduled without
+//        waiting for the mux. When both are needed the mux lock is taken first
+#define TIMERS_LOCK(_iom) if (_iom->timers_lock && __builtin_expect(pthread_mutex_lock((_iom->timers_lock)) != 0, 0)) { abort(); }
+#define TIMERS_UNLOCK(_iom) if (_iom->timers_lock && __builtin_expect(pthread_mutex_unlock((_iom->timers_lock)) != 0, 0)) { abort(); }
 
 #ifndef O_CLOEXEC
 #define O_CLOEXEC 0
 #endif
 
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define HAVE_MMSG
+#endif
+
+#if defined(__linux__) && defined(SOCK_NONBLOCK)
+#define HAVE_ACCEPT4
+#endif
+
+// maximum number of datagrams received/sent with a single syscall
+#define IOMUX_DATAGRAM_BATCH (32)
+// maximum number of events handled by each thread running a oneshot mux
+#define IOMUX_ONESHOT_BATCH (64)
+// maximum number of connections accepted on a listener at each runcycle
+#define IOMUX_ACCEPT_BUDGET_DEFAULT (128)
+// minimum size of the token bucket used to pace the output
+#define IOMUX_PACING_BURST_MIN (1<<12)
+
 void iomux_run(iomux_t *iomux, struct timeval *tv_default);
+static void iomux_handover_flush(iomux_t *iomux);
 
 int iomux_hangup = 0;
 
@@ -61,29 +121,89 @@ typedef struct _iomux_output_chunk_s {
     int len;
     int free;
     int offset;
+    // destination of datagrams queued with iomux_sendto()
+    struct sockaddr *addr;
+    socklen_t addrlen;
+    // chunks queued with iomux_write_keyed() can be replaced by newer ones
+    int keyed;
+    uint64_t key;
+    int priority;
+    // mux_free_data of the connection a chunk written by another thread is
+    // addressed to, used if the chunk is dropped before reaching its queue
+    iomux_free_data_callback_t free_cb;
+    void *free_priv;
     TAILQ_ENTRY(_iomux_output_chunk_s) next;
+    // room allocated for COPY mode payloads right after the chunk
+    int inline_size;
+    unsigned char inline_data[];
 } iomux_output_chunk_t;
 
 //! \brief iomux connection strucure
 typedef struct _iomux_connection_s {
     int fd;
+    uint32_t generation; // see iomux_connection_id()
     uint32_t flags;
     iomux_callbacks_t cbs;
+    // callbacks used to register connections accepted on a listener
+    iomux_callbacks_t *accept_cbs;
     unsigned char *inbuf;
-    int output_len;
+    int output_len; // bytes queued but not yet written
+    int output_low;
+    int output_high;
     TAILQ_HEAD(, _iomux_output_chunk_s) output_queue;
 
     int bufsize;
     int eof;
     int inlen;
     struct timeval expire_time;
+    struct timeval cork_expire;
+    // writable space passed to mux_output (see iomux_set_output_hint())
+    int output_hint;
+    // token bucket used to pace the output (see iomux_set_pacing_rate())
+    uint64_t pacing_rate;
+    int64_t pacing_burst;
+    int64_t pacing_tokens;
+    struct timeval pacing_last;
+    struct timeval pacing_wakeup;
     TAILQ_ENTRY(_iomux_connection_s) next;
-#if defined(HAVE_KQUEUE)
+    pthread_t owner; // the thread dispatching the connection if busy
+#if defined(HAVE_EPOLL)
+    uint32_t events; // the events currently registered on the epoll instance
+#elif defined(HAVE_KQUEUE)
     int16_t kfilters[2];
     struct kevent event[2];
 #endif
 } iomux_connection_t;
 
+//! \brief buffers used to receive a batch of datagrams
+typedef struct _iomux_datagram_batch_s {
+#if defined(HAVE_MMSG)
+    struct mmsghdr msgs[IOMUX_DATAGRAM_BATCH];
+    struct iovec iov[IOMUX_DATAGRAM_BATCH];
+#endif
+    struct sockaddr_storage addrs[IOMUX_DATAGRAM_BATCH];
+    unsigned char data[]; // IOMUX_DATAGRAM_BATCH slots of bufsize bytes
+} iomux_datagram_batch_t;
+
+//! \brief task posted to the mux by other threads (see iomux_post())
+typedef struct _iomux_task_s {
+    iomux_cb_t cb;
+    void *priv;
+    struct _iomux_task_s *next;
+} iomux_task_t;
+
+//! \brief connection on its way to another mux (see iomux_move_fd())
+typedef struct _iomux_handover_s {
+    iomux_t *src;
+    iomux_connection_t *conn;
+} iomux_handover_t;
+
+//! \brief how to release the data written to a connection with IOMUX_OUTPUT_MODE_FREE
+typedef struct _iomux_free_slot_s {
+    iomux_free_data_callback_t cb;
+    void *priv;
+} iomux_free_slot_t;
+
 //! \brief iomux timeout structure
 typedef struct _iomux_timeout {
     iomux_timeout_id_t id;
@@ -96,6 +216,12 @@ typedef struct _iomux_timeout {
 //! \brief IOMUX base structure
 struct _iomux {
     iomux_connection_t **connections;
+    // generation of the connection registered for each fd (0 if none),
+    // read without the lock to hand writes over (see iomux_queue_async())
+    uint32_t *generations;
+    // mux_free_data callback of the connection registered for each fd,
+    // published together with its generation (see iomux_free_slot_get())
+    iomux_free_slot_t *free_slots;
     TAILQ_HEAD(, _iomux_connection_s) connections_list;
     int maxfd;
     int minfd;
@@ -126,11 +252,73 @@ struct _iomux {
 
     int num_fds;
 
+    unsigned char **inbuf_pool;
+    int inbuf_pool_count;
+    int inbuf_pool_size;
+
+    TAILQ_HEAD(, _iomux_output_chunk_s) free_chunks;
+    int num_free_chunks;
+
+    unsigned char *overflow;
+    int overflow_size;
+
+    iomux_datagram_batch_t *dgram;
+
+    // bytes queued in the output queues of all the connections
+    size_t output_total;
+    size_t output_budget;
+    iomux_budget_policy_t budget_policy;
+    int budget_close; // the largest offenders must be closed (see iomux_run())
+    iomux_cb_t budget_cb;
+    void *budget_priv;
+
+    // mux_output is called only for connections passed to iomux_want_output()
+    int output_on_demand;
+
+    // lock-free stack of the tasks posted by other threads and the
+    // descriptors used to wake up the loop (the same eventfd on linux)
+    iomux_task_t *posted;
+    int wakeup_fd[2];
+    // lock-free stack of the chunks written by other threads (see iomux_write_async())
+    iomux_output_chunk_t *async_writes;
+
+    int accept_budget;
+    uint64_t accepted;
+    uint64_t accept_empty; // wakeups on a listener with no pending connections
+
+    // several threads run the mux concurrently (see iomux_set_oneshot())
+    int oneshot;
+    // the ready connections are handed to this callback (see iomux_set_executor())
+    iomux_executor_cb_t executor;
+    void *executor_priv;
+
     int emfile_fd;
 
     pthread_mutex_t *lock;
+    pthread_mutex_t *timers_lock;
+    // signaled when the timer callback being run returns (see iomux_timer_wait())
+    pthread_cond_t *timers_cond;
+    iomux_timeout_id_t running_timer;
+    iomux_cb_t running_cb;
+    void *running_priv;
+    pthread_t running_thread;
 };
 
+// the input being passed to mux_input (see iomux_input_take()),
+// oneshot muxes deliver input from several threads at once
+static __thread struct {
+    iomux_t *iomux;
+    unsigned char *data;
+    int len;
+    int fd;
+    int taken;
+} iomux_input_state;
+
+// generations are global and kept by iomux_move_fd(), so an id never matches
+// another connection on any mux and a moved connection keeps its id
+// (which has to be used with the destination mux from then on)
+static uint32_t iomux_generation = 0;
+
 static void set_error(iomux_t *iomux, char *fmt, ...) {
     va_list arg;
     va_start(arg, fmt);
@@ -141,6 +329,348 @@ static void set_error(iomux_t *iomux, char *fmt, ...) {
 
 #define IOMUX_FLUSH_MAXRETRIES 5    //!< Maximum number of iterations for flushing the output buffer
 
+// NOTE - allocates a chunk with room for a COPY mode payload of len bytes,
+//        never smaller than IOMUX_CHUNK_INLINE_SIZE so that it can be cached
+static iomux_output_chunk_t *
+iomux_chunk_alloc(int len, int mode)
+{
+    int size = (mode == IOMUX_OUTPUT_MODE_COPY && len > IOMUX_CHUNK_INLINE_SIZE)
+             ? len : IOMUX_CHUNK_INLINE_SIZE;
+    iomux_output_chunk_t *chunk = malloc(sizeof(iomux_output_chunk_t) + size);
+    if (chunk)
+        chunk->inline_size = size;
+    return chunk;
+}
+
+// NOTE - doesn't touch the mux so it can be used by any thread,
+//        COPY mode payloads must fit in the room of the chunk
+static void
+iomux_chunk_fill(iomux_output_chunk_t *chunk, unsigned char *data, int len, int mode)
+{
+    if (mode == IOMUX_OUTPUT_MODE_COPY) {
+        // the payload lives in the same allocation as the chunk
+        memcpy(chunk->inline_data, data, len);
+        chunk->data = chunk->inline_data;
+        chunk->free = 0;
+    } else {
+        // TODO - check for unknown output modes
+        chunk->data = data;
+        chunk->free = (mode != IOMUX_OUTPUT_MODE_NONE);
+    }
+    chunk->len = len;
+    chunk->offset = 0;
+    chunk->addr = NULL;
+    chunk->addrlen = 0;
+    chunk->keyed = 0;
+    chunk->key = 0;
+    chunk->priority = IOMUX_PRIORITY_NORMAL;
+}
+
+static iomux_output_chunk_t *
+iomux_chunk_create(iomux_t *iomux, unsigned char *data, int len, int mode)
+{
+    iomux_output_chunk_t *chunk = NULL;
+    // only chunks of the common size are cached
+    if (mode != IOMUX_OUTPUT_MODE_COPY || len <= IOMUX_CHUNK_INLINE_SIZE)
+        chunk = TAILQ_FIRST(&iomux->free_chunks);
+    if (chunk) {
+        TAILQ_REMOVE(&iomux->free_chunks, chunk, next);
+        iomux->num_free_chunks--;
+    } else {
+        chunk = iomux_chunk_alloc(len, mode);
+        if (!chunk) {
+            set_error(iomux, "%s: Can't allocate memory for the new chunk: %s", __FUNCTION__, strerror(errno));
+            return NULL;
+        }
+    }
+
+    iomux_chunk_fill(chunk, data, len, mode);
+    return chunk;
+}
+
+// NOTE - releases data written with IOMUX_OUTPUT_MODE_FREE
+//        through the mux_free_data callback of its connection, if any
+static void
+iomux_free_data(iomux_t *iomux, int fd, iomux_free_data_callback_t cb, void *priv,
+                unsigned char *data, int len)
+{
+    if (cb)
+        cb(iomux, fd, data, len, priv);
+    else
+        free(data);
+}
+
+static void
+iomux_chunk_destroy(iomux_t *iomux, iomux_connection_t *conn, iomux_output_chunk_t *chunk)
+{
+    if (chunk->free)
+        iomux_free_data(iomux, conn->fd, conn->cbs.mux_free_data, conn->cbs.priv, chunk->data, chunk->len);
+    free(chunk->addr);
+
+    if (chunk->inline_size == IOMUX_CHUNK_INLINE_SIZE && iomux->num_free_chunks < IOMUX_CHUNK_CACHE_MAX) {
+        TAILQ_INSERT_HEAD(&iomux->free_chunks, chunk, next);
+        iomux->num_free_chunks++;
+    } else {
+        free(chunk);
+    }
+}
+
+static inline void
+iomux_output_enqueue(iomux_t *iomux, iomux_connection_t *conn, iomux_output_chunk_t *chunk)
+{
+    iomux_output_chunk_t *pos = NULL;
+    if (chunk->priority > IOMUX_PRIORITY_NORMAL) {
+        // NOTE: the queue is kept sorted by priority, a chunk goes ahead of
+        //       all the lower priority ones not yet (even partially) written
+        TAILQ_FOREACH(pos, &conn->output_queue, next) {
+            if (pos->priority < chunk->priority && !pos->offset)
+                break;
+        }
+    }
+    if (pos)
+        TAILQ_INSERT_BEFORE(pos, chunk, next);
+    else
+        TAILQ_INSERT_TAIL(&conn->output_queue, chunk, next);
+    conn->output_len += chunk->len - chunk->offset;
+    iomux->output_total += chunk->len - chunk->offset;
+}
+
+static inline void
+iomux_output_advance(iomux_t *iomux, iomux_connection_t *conn, iomux_output_chunk_t *chunk, int len)
+{
+    chunk->offset += len;
+    conn->output_len -= len;
+    iomux->output_total -= len;
+}
+
+static inline void
+iomux_output_dequeue(iomux_t *iomux, iomux_connection_t *conn, iomux_output_chunk_t *chunk)
+{
+    TAILQ_REMOVE(&conn->output_queue, chunk, next);
+    conn->output_len -= chunk->len - chunk->offset;
+    iomux->output_total -= chunk->len - chunk->offset;
+    iomux_chunk_destroy(iomux, conn, chunk);
+}
+
+static inline int
+iomux_output_budget_exceeded(iomux_t *iomux, int len)
+{
+    return (iomux->output_budget && iomux->output_total + len > iomux->output_budget);
+}
+
+static iomux_connection_t *
+iomux_output_largest(iomux_t *iomux, int droppable)
+{
+    iomux_connection_t *conn, *largest = NULL;
+    TAILQ_FOREACH(conn, &iomux->connections_list, next) {
+        iomux_output_chunk_t *chunk = TAILQ_FIRST(&conn->output_queue);
+        // NOTE: a partially written chunk can't be dropped without
+        //       corrupting the stream
+        if (droppable && chunk && chunk->offset)
+            chunk = TAILQ_NEXT(chunk, next);
+        if (chunk && (!largest || conn->output_len > largest->output_len))
+            largest = conn;
+    }
+    return largest;
+}
+
+// NOTE - doesn't remove any connection so it's safe to call it
+//        while walking the connections list
+static void
+iomux_output_budget_drop(iomux_t *iomux)
+{
+    while (iomux->output_total > iomux->output_budget) {
+        iomux_connection_t *conn = iomux_output_largest(iomux, 1);
+        if (!conn)
+            break;
+        iomux_output_chunk_t *chunk = TAILQ_FIRST(&conn->output_queue);
+        if (chunk->offset)
+            chunk = TAILQ_NEXT(chunk, next);
+        while (chunk && iomux->output_total > iomux->output_budget) {
+            iomux_output_chunk_t *next = TAILQ_NEXT(chunk, next);
+            iomux_output_dequeue(iomux, conn, chunk);
+            chunk = next;
+        }
+    }
+}
+
+static void
+iomux_output_budget_close(iomux_t *iomux)
+{
+    iomux->budget_close = 0;
+    while (iomux->output_total > iomux->output_budget) {
+        iomux_connection_t *conn = iomux_output_largest(iomux, 0);
+        if (!conn)
+            break;
+        iomux_close(iomux, conn->fd);
+    }
+}
+
+// NOTE - called once the chunk has been queued, the budget has
+//        already been checked for the REJECT policy
+static void
+iomux_output_budget_apply(iomux_t *iomux)
+{
+    if (iomux->budget_policy == IOMUX_BUDGET_POLICY_DROP_OLDEST)
+        iomux_output_budget_drop(iomux);
+    else if (iomux->budget_policy == IOMUX_BUDGET_POLICY_CLOSE_LARGEST)
+        iomux->budget_close = 1; // connections are closed by iomux_run()
+}
+
+// NOTE - must be called when nothing else needs to be done on conn
+//        since the callbacks might remove it from the mux
+static void
+iomux_output_watermarks(iomux_t *iomux, iomux_connection_t *conn)
+{
+    if (!conn->output_high)
+        return;
+
+    if (!(conn->flags & IOMUX_CONNECTION_OUTPUT_FULL) && conn->output_len >= conn->output_high) {
+        conn->flags |= IOMUX_CONNECTION_OUTPUT_FULL;
+        if (conn->cbs.mux_output_full)
+            conn->cbs.mux_output_full(iomux, conn->fd, conn->output_len, conn->cbs.priv);
+    } else if ((conn->flags & IOMUX_CONNECTION_OUTPUT_FULL) && conn->output_len <= conn->output_low) {
+        conn->flags &= ~IOMUX_CONNECTION_OUTPUT_FULL;
+        if (conn->cbs.mux_output_drained)
+            conn->cbs.mux_output_drained(iomux, conn->fd, conn->output_len, conn->cbs.priv);
+    }
+}
+
+static inline unsigned char *
+iomux_inbuf_get(iomux_t *iomux)
+{
+    if (iomux->inbuf_pool_count)
+        return iomux->inbuf_pool[--iomux->inbuf_pool_count];
+    return malloc(iomux->bufsize);
+}
+
+static inline void
+iomux_inbuf_put(iomux_t *iomux, unsigned char *buf, int size)
+{
+    // NOTE: buffers coming from a mux with a different bufsize
+    //       (see iomux_move()) can't be recycled
+    if (size == iomux->bufsize && iomux->inbuf_pool_count < iomux->inbuf_pool_size)
+        iomux->inbuf_pool[iomux->inbuf_pool_count++] = buf;
+    else
+        free(buf);
+}
+
+// NOTE - TRUE if conn is being dispatched by the calling thread
+static inline int
+iomux_connection_owned(iomux_connection_t *conn)
+{
+    return ((conn->flags & IOMUX_CONNECTION_BUSY) && pthread_equal(conn->owner, pthread_self()));
+}
+
+// NOTE - TRUE if conn is being dispatched by another thread
+static inline int
+iomux_connection_busy(iomux_connection_t *conn)
+{
+    return ((conn->flags & IOMUX_CONNECTION_BUSY) && !pthread_equal(conn->owner, pthread_self()));
+}
+
+#if defined(HAVE_EPOLL)
+// NOTE - exclusive fds can't be oneshot, they are just never
+//        dispatched by two threads at once (see iomux_run())
+static inline uint32_t
+iomux_epoll_oneshot(iomux_t *iomux, iomux_connection_t *conn)
+{
+    return (iomux->oneshot && !(conn->flags & IOMUX_CONNECTION_EXCLUSIVE)) ? EPOLLONESHOT : 0;
+}
+
+// NOTE - EPOLLEXCLUSIVE can't be used with EPOLL_CTL_MOD,
+//        exclusive fds must be removed and added back
+static int
+iomux_epoll_exclusive(iomux_t *iomux, iomux_connection_t *conn, uint32_t events)
+{
+#if defined(EPOLLEXCLUSIVE)
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.data.fd = conn->fd;
+    event.events = events | EPOLLEXCLUSIVE;
+
+    epoll_ctl(iomux->efd, EPOLL_CTL_DEL, conn->fd, &event);
+    if (epoll_ctl(iomux->efd, EPOLL_CTL_ADD, conn->fd, &event) != 0) {
+        // NOTE: the fd is not registered anymore,
+        //       the next update will try adding it again
+        int err = errno;
+        fprintf(stderr, "Errors adding fd %d to epoll instance %d : %s\n",
+                conn->fd, iomux->efd, strerror(err));
+        conn->events = 0;
+        errno = err;
+        return 0;
+    }
+    return 1;
+#else
+    errno = ENOTSUP;
+    return 0;
+#endif
+}
+
+// NOTE - registers conn for the events it needs, skipping the syscall if
+//        nothing changed. Input events are left out while input is blocked
+static int
+iomux_epoll_update(iomux_t *iomux, iomux_connection_t *conn, int output)
+{
+    uint32_t events = output ? EPOLLOUT : 0;
+    if (!(conn->flags & IOMUX_CONNECTION_INPUT_BLOCKED))
+        events |= EPOLLIN;
+
+    if (events == conn->events)
+        return 1;
+
+    // a oneshot fd being dispatched is disarmed, the thread
+    // dispatching it registers the new events once done
+    if ((conn->flags & IOMUX_CONNECTION_BUSY) && iomux_epoll_oneshot(iomux, conn)) {
+        conn->events = events;
+        return 1;
+    }
+
+    if (conn->flags & IOMUX_CONNECTION_EXCLUSIVE) {
+        if (!iomux_epoll_exclusive(iomux, conn, events))
+            return 0;
+        conn->events = events;
+        return 1;
+    }
+
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.data.fd = conn->fd;
+    event.events = events | iomux_epoll_oneshot(iomux, conn);
+
+    int rc = epoll_ctl(iomux->efd, EPOLL_CTL_MOD, conn->fd, &event);
+    if (rc == -1)
+        return 0;
+
+    conn->events = events;
+    return 1;
+}
+#endif
+
+// NOTE - called when the input of conn has been blocked or unblocked
+//        kqueue and select register input events at each iomux_run()
+//        so only epoll needs to be updated here
+static void
+iomux_input_interest(iomux_t *iomux, iomux_connection_t *conn)
+{
+#if defined(HAVE_EPOLL)
+    if (!iomux_epoll_update(iomux, conn, conn->events & EPOLLOUT)) {
+        fprintf(stderr, "Errors modifying fd %d on epoll instance %d : %s\n",
+                conn->fd, iomux->efd, strerror(errno));
+    }
+#endif
+}
+
+// NOTE - resumes reading once the application consumed some of the input
+static inline void
+iomux_input_check_full(iomux_t *iomux, iomux_connection_t *conn)
+{
+    if ((conn->flags & IOMUX_CONNECTION_INPUT_FULL) && (!conn->inbuf || conn->inlen < conn->bufsize)) {
+        conn->flags &= ~IOMUX_CONNECTION_INPUT_FULL;
+        iomux_input_interest(iomux, conn);
+    }
+}
+
 static void
 iomux_timeout_destroy(iomux_timeout_t *timeout)
 {
@@ -150,6 +680,83 @@ iomux_timeout_destroy(iomux_timeout_t *timeout)
     
 }
 
+// NOTE - the read end of the wakeup descriptor is polled together with the
+//        connections (but it's not part of the connections table)
+static int
+iomux_wakeup_init(iomux_t *iomux)
+{
+#if defined(__linux__)
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd == -1)
+        return 0;
+    iomux->wakeup_fd[0] = iomux->wakeup_fd[1] = efd;
+#else
+    if (pipe(iomux->wakeup_fd) != 0)
+        return 0;
+    int i;
+    for (i = 0; i < 2; i++) {
+        fcntl(iomux->wakeup_fd[i], F_SETFL, O_NONBLOCK);
+        fcntl(iomux->wakeup_fd[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+#if defined(HAVE_EPOLL)
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.data.fd = iomux->wakeup_fd[0];
+    event.events = EPOLLIN;
+    if (epoll_ctl(iomux->efd, EPOLL_CTL_ADD, iomux->wakeup_fd[0], &event) != 0)
+        return 0;
+#elif defined(HAVE_KQUEUE)
+    struct kevent event;
+    EV_SET(&event, iomux->wakeup_fd[0], EVFILT_READ, EV_ADD, 0, 0, 0);
+    if (kevent(iomux->kfd, &event, 1, NULL, 0, NULL) != 0)
+        return 0;
+#endif
+    return 1;
+}
+
+static void
+iomux_wakeup(iomux_t *iomux)
+{
+    uint64_t val = 1;
+    if (write(iomux->wakeup_fd[1], &val, sizeof(val)) == -1 && errno != EAGAIN)
+        fprintf(stderr, "Can't wake up the mux : %s\n", strerror(errno));
+}
+
+static void
+iomux_wakeup_clear(iomux_t *iomux)
+{
+    uint64_t val;
+    while (read(iomux->wakeup_fd[0], &val, sizeof(val)) > 0)
+        ;
+}
+
+// NOTE - runs, in the order they have been posted, all the tasks
+//        pushed to the mux since the last time
+static void
+iomux_run_posted(iomux_t *iomux)
+{
+    if (!__atomic_load_n(&iomux->posted, __ATOMIC_ACQUIRE))
+        return;
+
+    iomux_task_t *task = __atomic_exchange_n(&iomux->posted, NULL, __ATOMIC_ACQ_REL);
+    iomux_task_t *fifo = NULL;
+    while (task) {
+        iomux_task_t *next = task->next;
+        task->next = fifo;
+        fifo = task;
+        task = next;
+    }
+
+    while (fifo) {
+        task = fifo;
+        fifo = task->next;
+        task->cb(iomux, task->priv);
+        free(task);
+    }
+}
+
 iomux_t *
 iomux_create(int bufsize, int threadsafe)
 {
@@ -161,6 +768,9 @@ iomux_create(int bufsize, int threadsafe)
     }
 
     iomux->bufsize = (bufsize > 0) ? bufsize : IOMUX_CONNECTION_BUFSIZE_DEFAULT;
+    iomux->overflow_size = IOMUX_READ_OVERFLOW_DEFAULT;
+    iomux->accept_budget = IOMUX_ACCEPT_BUDGET_DEFAULT;
+    iomux->wakeup_fd[0] = iomux->wakeup_fd[1] = -1;
 
     struct rlimit rlim;
     if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
@@ -201,12 +811,15 @@ iomux_create(int bufsize, int threadsafe)
 
 
     iomux->connections = calloc(1, sizeof(iomux_connection_t *) * iomux->maxconnections);
-    if (!iomux->connections) {
+    iomux->generations = calloc(iomux->maxconnections, sizeof(uint32_t));
+    iomux->free_slots = calloc(iomux->maxconnections, sizeof(iomux_free_slot_t));
+    if (!iomux->connections || !iomux->generations || !iomux->free_slots) {
         fprintf(stderr, "Errors creating the connections array : %s\n", strerror(errno));
         iomux_destroy(iomux);
         return NULL;
     }
     TAILQ_INIT(&iomux->connections_list);
+    TAILQ_INIT(&iomux->free_chunks);
 
     iomux->timeouts = bh_create((bh_free_value_callback_t)iomux_timeout_destroy);
     if (!iomux->timeouts) {
@@ -231,6 +844,24 @@ iomux_create(int bufsize, int threadsafe)
             return NULL;
         }
         pthread_mutexattr_destroy(&attr);
+
+        iomux->timers_lock = malloc(sizeof(pthread_mutex_t));
+        if (!iomux->timers_lock || pthread_mutex_init(iomux->timers_lock, NULL) != 0) {
+            fprintf(stderr, "Can't create the iomux timers mutex : %s\n", strerror(errno));
+            free(iomux->timers_lock);
+            iomux->timers_lock = NULL;
+            iomux_destroy(iomux);
+            return NULL;
+        }
+
+        iomux->timers_cond = malloc(sizeof(pthread_cond_t));
+        if (!iomux->timers_cond || pthread_cond_init(iomux->timers_cond, NULL) != 0) {
+            fprintf(stderr, "Can't create the iomux timers condition : %s\n", strerror(errno));
+            free(iomux->timers_cond);
+            iomux->timers_cond = NULL;
+            iomux_destroy(iomux);
+            return NULL;
+        }
     }
     iomux->last_timeout_id = 0;
 
@@ -245,92 +876,200 @@ iomux_create(int bufsize, int threadsafe)
         iomux_destroy(iomux);
         return NULL;
     }
+
+    if (!iomux_wakeup_init(iomux)) {
+        fprintf(stderr, "Can't create the wakeup descriptor : %s\n", strerror(errno));
+        iomux_destroy(iomux);
+        return NULL;
+    }
     return iomux;
 }
 
-int
-iomux_add(iomux_t *iomux, int fd, iomux_callbacks_t *cbs)
+// NOTE - registers an initialized connection with the mux
+//        (either a new one or one detached from another mux)
+static int
+iomux_connection_attach(iomux_t *iomux, iomux_connection_t *conn)
 {
-    iomux_connection_t *connection = NULL;
+    int fd = conn->fd;
 
-    if (fd >= iomux->maxconnections)
+#if defined(HAVE_EPOLL)
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.data.fd = fd;
+    if (!(conn->flags & IOMUX_CONNECTION_INPUT_BLOCKED))
+        event.events = EPOLLIN;
+    if ((conn->cbs.mux_output && !iomux->output_on_demand) ||
+        (conn->flags & IOMUX_CONNECTION_OUTPUT_WANTED) ||
+        !TAILQ_EMPTY(&conn->output_queue))
+    {
+        event.events |= EPOLLOUT;
+    }
+    conn->events = event.events;
+    event.events |= iomux_epoll_oneshot(iomux, conn);
+#if defined(EPOLLEXCLUSIVE)
+    if (conn->flags & IOMUX_CONNECTION_EXCLUSIVE)
+        event.events |= EPOLLEXCLUSIVE;
+#endif
+    int rc = epoll_ctl(iomux->efd, EPOLL_CTL_ADD, fd, &event);
+    if (rc == -1) {
+        fprintf(stderr, "Errors adding fd %d to epoll instance %d : %s\n",
+                fd, iomux->efd, strerror(errno));
+        set_error(iomux, "Can't add fd %d to the epoll instance: %s", fd, strerror(errno));
         return 0;
+    }
 
-    MUTEX_LOCK(iomux);
+#elif defined(HAVE_KQUEUE)
+    conn->kfilters[0] = EVFILT_READ;
+    conn->kfilters[1] = EVFILT_WRITE;
 
-    if (fd < 0) {
-        set_error(iomux, "fd %d is invalid", fd);
-        MUTEX_UNLOCK(iomux);
-        return 0;
-    } else if (fd >= iomux->maxconnections) {
-        set_error(iomux, "fd %d exceeds max fd %d", fd, iomux->maxconnections);
-        MUTEX_UNLOCK(iomux);
-        return 0;
-    }
+    EV_SET(&conn->event[0], fd, conn->kfilters[0], EV_ADD | EV_ONESHOT, 0, 0, 0);
+    EV_SET(&conn->event[1], fd, conn->kfilters[1], EV_DELETE | EV_ONESHOT, 0, 0, 0);
+#endif
 
-    if (iomux->connections[fd]) {
-        set_error(iomux, "filedescriptor %d already added", fd);
-        MUTEX_UNLOCK(iomux);
-        return 0;
-    }
-    if (!cbs) {
-        set_error(iomux, "no callbacks have been specified, skipping filedescriptor %d", fd);
-        MUTEX_UNLOCK(iomux);
-        return 0;
-    }
+    if (fd > iomux->maxfd)
+        iomux->maxfd = fd;
+    if (fd < iomux->minfd)
+        iomux->minfd = fd;
+
+    iomux->connections[fd] = conn;
+    __atomic_store_n(&iomux->free_slots[fd].cb, conn->cbs.mux_free_data, __ATOMIC_RELAXED);
+    __atomic_store_n(&iomux->free_slots[fd].priv, conn->cbs.priv, __ATOMIC_RELAXED);
+    __atomic_store_n(&iomux->generations[fd], conn->generation, __ATOMIC_RELEASE);
+    iomux->num_fds++;
+    while (!iomux->connections[iomux->minfd] && iomux->minfd != iomux->maxfd)
+        iomux->minfd++;
+
+    TAILQ_INSERT_TAIL(&iomux->connections_list, conn, next);
+    iomux->output_total += conn->output_len;
+    return 1;
+}
 
-    fcntl(fd, F_SETFL, O_NONBLOCK);
-    connection = (iomux_connection_t *)calloc(1, sizeof(iomux_connection_t));
-    if (connection) {
+// NOTE - unregisters the connection from the mux without releasing it
+static iomux_connection_t *
+iomux_connection_detach(iomux_t *iomux, int fd)
+{
+    iomux_connection_t *conn = iomux->connections[fd];
 
 #if defined(HAVE_EPOLL)
-        struct epoll_event event;
-        bzero(&event, sizeof(event));
-        event.data.fd = fd;
-        event.events = EPOLLIN;
-        if (cbs->mux_output)
-            event.events |= EPOLLOUT;
-        int rc = epoll_ctl(iomux->efd, EPOLL_CTL_ADD, fd, &event);
-        if (rc == -1) {
-            fprintf(stderr, "Errors adding fd %d to epoll instance %d : %s\n",
-                    fd, iomux->efd, strerror(errno));
-            free(connection);
-            MUTEX_UNLOCK(iomux);
-            return 0;
-        }
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.data.fd = fd;
 
-#elif defined(HAVE_KQUEUE)
-        connection->kfilters[0] = EVFILT_READ;
-        connection->kfilters[1] = EVFILT_WRITE;
+    // NOTE: events might be NULL but on linux kernels < 2.6.9
+    //       it was required to be non-NULL even if ignored
+    event.events = EPOLLIN | EPOLLOUT;
 
-        EV_SET(&connection->event[0], fd, connection->kfilters[0], EV_ADD | EV_ONESHOT, 0, 0, 0);
-        EV_SET(&connection->event[1], fd, connection->kfilters[1], EV_DELETE | EV_ONESHOT, 0, 0, 0);
+    // NOTE: if the fd has been already closed epoll_ctl would return an error
+    epoll_ctl(iomux->efd, EPOLL_CTL_DEL, fd, &event);
+#elif defined(HAVE_KQUEUE)
+    int i;
+    for (i = 0; i < 2; i++) {
+        EV_SET(&conn->event[i], fd, conn->kfilters[i], EV_DELETE | EV_ONESHOT, 0, 0, 0);
+    }
 #endif
+    TAILQ_REMOVE(&iomux->connections_list, conn, next);
+    iomux->connections[fd] = NULL;
+    __atomic_store_n(&iomux->generations[fd], 0, __ATOMIC_RELEASE);
+    // NOTE: the free slot of fd can't be overwritten before the generation
+    //       has been cleared (see iomux_free_slot_get())
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    iomux->num_fds--;
+    iomux->output_total -= conn->output_len;
+
+    if (iomux->maxfd == fd)
+        while (iomux->maxfd > 0 && !iomux->connections[iomux->maxfd])
+            iomux->maxfd--;
+
+    if (iomux->minfd == fd) {
+        if (iomux->minfd < iomux->maxfd)
+            while (iomux->minfd != iomux->maxfd && !iomux->connections[iomux->minfd])
+                iomux->minfd++;
+        else
+            iomux->minfd = iomux->maxfd;
+    }
+    return conn;
+}
+
+static void
+iomux_connection_free(iomux_t *iomux, iomux_connection_t *conn)
+{
+    free(conn->accept_cbs);
+    if (conn->inbuf)
+        iomux_inbuf_put(iomux, conn->inbuf, conn->bufsize);
+    iomux_output_chunk_t *chunk;
+    while ((chunk = TAILQ_FIRST(&conn->output_queue))) {
+        TAILQ_REMOVE(&conn->output_queue, chunk, next);
+        iomux_chunk_destroy(iomux, conn, chunk);
+    }
+    free(conn);
+}
+
+// NOTE - nonblocking is TRUE if fd has been already set as non-blocking
+//        (as for connections accepted with accept4())
+static int
+iomux_add_fd(iomux_t *iomux, int fd, iomux_callbacks_t *cbs, int nonblocking)
+{
+    iomux_connection_t *connection = NULL;
+
+    if (fd >= iomux->maxconnections)
+        return 0;
+
+    MUTEX_LOCK(iomux);
+
+    if (fd < 0) {
+        set_error(iomux, "fd %d is invalid", fd);
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    } else if (fd >= iomux->maxconnections) {
+        set_error(iomux, "fd %d exceeds max fd %d", fd, iomux->maxconnections);
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
 
-        if (fd > iomux->maxfd)
-            iomux->maxfd = fd;
-        if (fd < iomux->minfd)
-            iomux->minfd = fd;
+    if (iomux->connections[fd]) {
+        set_error(iomux, "filedescriptor %d already added", fd);
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+    if (!cbs) {
+        set_error(iomux, "no callbacks have been specified, skipping filedescriptor %d", fd);
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
 
+    if (!nonblocking)
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    connection = (iomux_connection_t *)calloc(1, sizeof(iomux_connection_t));
+    if (connection) {
         memcpy(&connection->cbs, cbs, sizeof(connection->cbs));
 
-        connection->inbuf = malloc(iomux->bufsize);
-        if (!connection->inbuf) {
-            set_error(iomux, "Can't allocate memory for the input buffer: %s", strerror(errno));
-            MUTEX_UNLOCK(iomux);
-            free(connection);
-            return 0;
+        // NOTE: if the input pool is enabled the buffer will be
+        //       attached only when there is actually something to read,
+        //       raw filedescriptors are read by the application itself
+        //       and datagrams are received in the per-mux batch buffers
+        if (!iomux->inbuf_pool_size && !cbs->mux_readable && !cbs->mux_datagram) {
+            connection->inbuf = malloc(iomux->bufsize);
+            if (!connection->inbuf) {
+                set_error(iomux, "Can't allocate memory for the input buffer: %s", strerror(errno));
+                MUTEX_UNLOCK(iomux);
+                free(connection);
+                return 0;
+            }
         }
         TAILQ_INIT(&connection->output_queue);
         connection->bufsize = iomux->bufsize;
         connection->fd = fd;
+        do {
+            connection->generation = __atomic_add_fetch(&iomux_generation, 1, __ATOMIC_RELAXED);
+        } while (!connection->generation);
 
-        iomux->connections[fd] = connection;
-        iomux->num_fds++;
-        while (!iomux->connections[iomux->minfd] && iomux->minfd != iomux->maxfd)
-            iomux->minfd++;
+        if (!iomux_connection_attach(iomux, connection)) {
+            free(connection->inbuf);
+            free(connection);
+            MUTEX_UNLOCK(iomux);
+            return 0;
+        }
 
-        TAILQ_INSERT_TAIL(&iomux->connections_list, connection, next);
         // if we have no emfile_fd saved, let's open one now
         // it could have been previously closed because we
         // reached the EMFILE condition but we were not able
@@ -350,6 +1089,12 @@ iomux_add(iomux_t *iomux, int fd, iomux_callbacks_t *cbs)
     return 0;
 }
 
+int
+iomux_add(iomux_t *iomux, int fd, iomux_callbacks_t *cbs)
+{
+    return iomux_add_fd(iomux, fd, cbs, 0);
+}
+
 int
 iomux_remove(iomux_t *iomux, int fd)
 {
@@ -360,53 +1105,15 @@ iomux_remove(iomux_t *iomux, int fd)
         return 0;
     }
 
-#if defined(HAVE_EPOLL)
-    struct epoll_event event;
-    bzero(&event, sizeof(event));
-    event.data.fd = fd;
-
-    // NOTE: events might be NULL but on linux kernels < 2.6.9
-    //       it was required to be non-NULL even if ignored
-    event.events = EPOLLIN | EPOLLOUT;
-
-    // NOTE: if the fd has been already closed epoll_ctl would return an error
-    epoll_ctl(iomux->efd, EPOLL_CTL_DEL, fd, &event);
-#elif defined(HAVE_KQUEUE)
-    int i;
-    for (i = 0; i < 2; i++) {
-        EV_SET(&iomux->connections[fd]->event[i], fd, iomux->connections[fd]->kfilters[i], EV_DELETE | EV_ONESHOT, 0, 0, 0);
-    }
-#endif
-    TAILQ_REMOVE(&iomux->connections_list, iomux->connections[fd], next);
-    if (iomux->connections[fd]->inbuf)
-        free(iomux->connections[fd]->inbuf);
-    iomux_output_chunk_t *chunk = TAILQ_FIRST(&iomux->connections[fd]->output_queue);
-    while (chunk) {
-        TAILQ_REMOVE(&iomux->connections[fd]->output_queue, chunk, next);
-        if (chunk->free) {
-            if (iomux->connections[fd]->cbs.mux_free_data)
-                iomux->connections[fd]->cbs.mux_free_data(iomux, fd, chunk->data, chunk->len, iomux->connections[fd]->cbs.priv);
-            else
-                free(chunk->data);
-        }
-        free(chunk);
-        chunk = TAILQ_FIRST(&iomux->connections[fd]->output_queue);
+    if (iomux_connection_busy(iomux->connections[fd])) {
+        // removed by the thread dispatching it as soon as it's done
+        iomux->connections[fd]->flags |= IOMUX_CONNECTION_REMOVE_PENDING;
+        MUTEX_UNLOCK(iomux);
+        return 1;
     }
-    free(iomux->connections[fd]);
-    iomux->connections[fd] = NULL;
-    iomux->num_fds--;
 
-    if (iomux->maxfd == fd)
-        while (iomux->maxfd > 0 && !iomux->connections[iomux->maxfd])
-            iomux->maxfd--;
+    iomux_connection_free(iomux, iomux_connection_detach(iomux, fd));
 
-    if (iomux->minfd == fd) {
-        if (iomux->minfd < iomux->maxfd)
-            while (iomux->minfd != iomux->maxfd && !iomux->connections[iomux->minfd])
-                iomux->minfd++;
-        else
-            iomux->minfd = iomux->maxfd;
-    }
     MUTEX_UNLOCK(iomux);
     return 1;
 }
@@ -425,7 +1132,7 @@ iomux_schedule(iomux_t *iomux,
         return 0;
     }
 
-    MUTEX_LOCK(iomux);
+    TIMERS_LOCK(iomux);
 
     struct timeval now;
     gettimeofday(&now, NULL);
@@ -435,7 +1142,7 @@ iomux_schedule(iomux_t *iomux,
     timeout = (iomux_timeout_t *)calloc(1, sizeof(iomux_timeout_t));
     if (!timeout) {
         // TODO - set an error message
-        MUTEX_UNLOCK(iomux);
+        TIMERS_UNLOCK(iomux);
         return 0;
     }
     timeradd(&now, tv, &timeout->expire_time);
@@ -449,12 +1156,13 @@ iomux_schedule(iomux_t *iomux,
     // keep the list sorted in ascending order
     if (bh_insert(iomux->timeouts, timeout->id, timeout, sizeof(iomux_timeout_t)) != 0) {
         fprintf(stderr, "Can't insert a new node in the binomial heap\n");
-        MUTEX_UNLOCK(iomux);
+        TIMERS_UNLOCK(iomux);
         free(timeout);
         return 0;
     }
-    MUTEX_UNLOCK(iomux);
-    return timeout->id;
+    iomux_timeout_id_t id = timeout->id;
+    TIMERS_UNLOCK(iomux);
+    return id;
 }
 
 iomux_timeout_id_t
@@ -469,6 +1177,23 @@ iomux_reschedule(iomux_t *iomux,
     return iomux_schedule(iomux, tv, cb, priv, free_ctx_cb);
 }
 
+// NOTE - called holding the timers lock, waits until the timer callback being run
+//        by another thread (if it's one of those being unscheduled) returns, so that
+//        the caller can release its context right away.
+//        A timer callback unscheduling itself (or any other timer) doesn't wait
+static void
+iomux_timer_wait(iomux_t *iomux, iomux_timeout_id_t id, iomux_cb_t cb, void *priv)
+{
+    if (!iomux->timers_cond)
+        return;
+
+    while (iomux->running_timer && !pthread_equal(iomux->running_thread, pthread_self()) &&
+           (id ? iomux->running_timer == id : (iomux->running_cb == cb && iomux->running_priv == priv)))
+    {
+        pthread_cond_wait(iomux->timers_cond, iomux->timers_lock);
+    }
+}
+
 typedef struct {
     iomux_t *iomux;
     iomux_cb_t cb;
@@ -493,12 +1218,13 @@ iomux_binheap_iterator_callback(bh_t *bh, uint64_t key, void *value, size_t vlen
 int
 iomux_unschedule_all(iomux_t *iomux, iomux_cb_t cb, void *priv)
 {
-    MUTEX_LOCK(iomux);
+    TIMERS_LOCK(iomux);
 
     iomux_binheap_iterator_arg_t arg = { iomux, cb, priv, 0 };
     bh_foreach(iomux->timeouts, iomux_binheap_iterator_callback, &arg);
+    iomux_timer_wait(iomux, 0, cb, priv);
 
-    MUTEX_UNLOCK(iomux);
+    TIMERS_UNLOCK(iomux);
 
     return arg.count;
 }
@@ -509,17 +1235,19 @@ iomux_unschedule(iomux_t *iomux, iomux_timeout_id_t id)
     if (!id)
         return 0;
 
-    MUTEX_LOCK(iomux);
+    TIMERS_LOCK(iomux);
     void *timeout_ptr = NULL;
     if (bh_delete(iomux->timeouts, id, &timeout_ptr, NULL) != 0) {
-        MUTEX_UNLOCK(iomux);
+        // the timer might be firing right now
+        iomux_timer_wait(iomux, id, NULL, NULL);
+        TIMERS_UNLOCK(iomux);
         return 0;
     }
+    TIMERS_UNLOCK(iomux);
 
     if (timeout_ptr)
         free(timeout_ptr);
 
-    MUTEX_UNLOCK(iomux);
     return 1;
 }
 
@@ -557,8 +1285,8 @@ iomux_set_timeout(iomux_t *iomux, int fd, struct timeval *tv)
     MUTEX_UNLOCK(iomux);
 }
 
-int
-iomux_listen(iomux_t *iomux, int fd)
+static int
+iomux_listen_fd(iomux_t *iomux, int fd, int exclusive)
 {
     MUTEX_LOCK(iomux);
     if (!iomux->connections[fd]) {
@@ -566,7 +1294,9 @@ iomux_listen(iomux_t *iomux, int fd)
         MUTEX_UNLOCK(iomux);
         return 0;
     }
-    assert(iomux->connections[fd]->cbs.mux_connection);
+    assert(iomux->connections[fd]->cbs.mux_connection ||
+           iomux->connections[fd]->cbs.mux_accept ||
+           iomux->connections[fd]->accept_cbs);
 
     if (listen(fd, -1) != 0) {
         set_error(iomux, "%s: Error listening on fd %d: %s", __FUNCTION__, fd, strerror(errno));
@@ -576,10 +1306,33 @@ iomux_listen(iomux_t *iomux, int fd)
 
     iomux->connections[fd]->flags = iomux->connections[fd]->flags | IOMUX_CONNECTION_SERVER;
 
+#if defined(HAVE_EPOLL)
+    if (exclusive && !(iomux->connections[fd]->flags & IOMUX_CONNECTION_EXCLUSIVE)) {
+        if (!iomux_epoll_exclusive(iomux, iomux->connections[fd], iomux->connections[fd]->events)) {
+            set_error(iomux, "%s: Can't register fd %d as exclusive: %s", __FUNCTION__, fd, strerror(errno));
+            MUTEX_UNLOCK(iomux);
+            return 0;
+        }
+        iomux->connections[fd]->flags |= IOMUX_CONNECTION_EXCLUSIVE;
+    }
+#endif
+
     MUTEX_UNLOCK(iomux);
     return 1;
 }
 
+int
+iomux_listen(iomux_t *iomux, int fd)
+{
+    return iomux_listen_fd(iomux, fd, 0);
+}
+
+int
+iomux_listen_exclusive(iomux_t *iomux, int fd)
+{
+    return iomux_listen_fd(iomux, fd, 1);
+}
+
 void
 iomux_loop_next_cb(iomux_t *iomux, iomux_cb_t cb, void *priv)
 {
@@ -601,27 +1354,72 @@ iomux_hangup_cb(iomux_t *iomux, iomux_cb_t cb, void *priv)
     iomux->hangup_priv = priv;
 }
 
-// NOTE - this MUST be called while the lock is NOT retained
+static inline int
+iomux_accept(int fd, struct sockaddr_storage *peer, socklen_t *socklen)
+{
+    *socklen = sizeof(struct sockaddr_storage);
+#if defined(HAVE_ACCEPT4)
+    return accept4(fd, (struct sockaddr *)peer, socklen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int newfd = accept(fd, (struct sockaddr *)peer, socklen);
+    if (newfd >= 0) {
+        fcntl(newfd, F_SETFL, O_NONBLOCK);
+        fcntl(newfd, F_SETFD, FD_CLOEXEC);
+    }
+    return newfd;
+#endif
+}
+
+// NOTE - accepts at most accept_budget connections, the remaining ones
+//        will be accepted at the next runcycle (the listener is still readable)
 static void
-iomux_accept_connections_fd(iomux_t *iomux,
-                            int fd,
-                            iomux_connection_callback_t mux_connection,
-                            void *priv)
-{
-    int newfd;
-    struct sockaddr_in peer;
-    socklen_t socklen = sizeof(struct sockaddr);
-    // if it is, accept all pending connections and add them to the mux
-    while ((newfd = accept(fd, (struct sockaddr *)&peer, &socklen)) >= 0) {
-        if (mux_connection)
+iomux_accept_connections_fd(iomux_t *iomux, int fd)
+{
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *listener = iomux->connections[fd];
+    iomux_connection_callback_t mux_connection = listener->cbs.mux_connection;
+    iomux_accept_callback_t mux_accept = listener->cbs.mux_accept;
+    void *priv = listener->cbs.priv;
+    // NOTE: a callback might remove the listener so we need our own copy
+    iomux_callbacks_t accept_cbs;
+    int autoadd = (listener->accept_cbs != NULL);
+    if (autoadd)
+        memcpy(&accept_cbs, listener->accept_cbs, sizeof(accept_cbs));
+
+    int newfd = -1;
+    int count = 0;
+    struct sockaddr_storage peer;
+    socklen_t socklen;
+    while (!iomux->accept_budget || count < iomux->accept_budget) {
+        newfd = iomux_accept(fd, &peer, &socklen);
+        if (newfd < 0) {
+            // NOTE: another process (or mux) sharing the listener got there first
+            if (!count && (errno == EAGAIN || errno == EWOULDBLOCK))
+                iomux->accept_empty++;
+            break;
+        }
+        count++;
+        iomux->accepted++;
+
+        if (autoadd && !iomux_add_fd(iomux, newfd, &accept_cbs, 1)) {
+            fprintf(stderr, "Can't register the accepted connection %d: %s\n", newfd, iomux->error);
+            close(newfd);
+            continue;
+        }
+
+        if (mux_accept)
+            mux_accept(iomux, newfd, (struct sockaddr *)&peer, socklen, priv);
+        else if (mux_connection)
             mux_connection(iomux, newfd, priv);
+
+        if (iomux->connections[fd] != listener) // the listener has been removed
+            break;
     }
-    if (errno == EMFILE || errno == ENFILE) {
+    if (newfd < 0 && (errno == EMFILE || errno == ENFILE)) {
         fprintf(stderr, "Maximum number of filedescriptors reached, can't accept new connections!\n");
-        MUTEX_LOCK(iomux);
         if (iomux->emfile_fd >= 0) {
             close(iomux->emfile_fd);
-            while((newfd = accept(fd, (struct sockaddr *)&peer, &socklen)) >= 0)
+            while((newfd = iomux_accept(fd, &peer, &socklen)) >= 0)
                 close(newfd); // let's signal clients we are overloaded
             // NOTE: if some other thread got the freed filedescriptor we won't be
             //       able to get it back. If this happens we will try saving the
@@ -629,125 +1427,590 @@ iomux_accept_connections_fd(iomux_t *iomux,
             //       (as iomux_add() and iomux_close())
             iomux->emfile_fd = open("/", O_CLOEXEC);
         }
-        MUTEX_UNLOCK(iomux);
     }
+    MUTEX_UNLOCK(iomux);
 }
 
-static void
-iomux_read_fd(iomux_t *iomux, int fd, iomux_input_callback_t mux_input, void *priv)
+// NOTE - makes sure the connection has an input buffer able to hold at least size bytes
+static int
+iomux_inbuf_reserve(iomux_t *iomux, iomux_connection_t *conn, int size)
 {
-    MUTEX_LOCK(iomux);
-    iomux_connection_t *conn = iomux->connections[fd];
+    if (!conn->inbuf) {
+        conn->inbuf = iomux_inbuf_get(iomux);
+        if (!conn->inbuf) {
+            set_error(iomux, "Can't allocate memory for the input buffer: %s", strerror(errno));
+            return 0;
+        }
+        conn->bufsize = iomux->bufsize;
+    }
+    if (size > conn->bufsize) {
+        unsigned char *inbuf = realloc(conn->inbuf, size);
+        if (!inbuf) {
+            set_error(iomux, "Can't grow the input buffer to %d bytes: %s", size, strerror(errno));
+            return 0;
+        }
+        conn->inbuf = inbuf;
+        conn->bufsize = size;
+    }
+    return 1;
+}
 
-    if (conn->inlen >= conn->bufsize) {
+// NOTE - data is either the connection buffer (and len is equal to inlen)
+//        or the overflow buffer (in which case the connection buffer is empty)
+//        returns 0 if the connection has been closed/removed by the callback
+static int
+iomux_input_deliver(iomux_t *iomux, iomux_connection_t *conn, unsigned char *data, int len,
+                    iomux_input_callback_t mux_input, void *priv)
+{
+    int fd = conn->fd;
+
+    iomux_t *prev_iomux = iomux_input_state.iomux;
+    unsigned char *prev_data = iomux_input_state.data;
+    int prev_len = iomux_input_state.len;
+    int prev_fd = iomux_input_state.fd;
+    iomux_input_state.iomux = iomux;
+    iomux_input_state.data = data;
+    iomux_input_state.len = len;
+    iomux_input_state.fd = fd;
+    iomux_input_state.taken = 0;
+
+    // NOTE: a connection dispatched by a oneshot mux can't be touched
+    //       by the other threads, so mux_input can run without the lock
+    //       (which is held only once by iomux_read_fd() in that case)
+    int unlocked = iomux_connection_owned(conn);
+    if (unlocked)
         MUTEX_UNLOCK(iomux);
-        return;
-    }
 
-    int rb = read(fd, conn->inbuf + conn->inlen, conn->bufsize - conn->inlen);
+    int mb = mux_input(iomux, fd, data, len, priv);
 
-    if (rb == -1) {
-        if (errno != EINTR && errno != EAGAIN) {
-            // don't output warnings if the filedescriptor has been closed
-            // without informing the iomux or if the connection has been
-            // dropped by the peer
-            if (errno != EBADF && errno != ECONNRESET)
-                fprintf(stderr, "read on fd %d failed: %s\n", fd, strerror(errno));
-            iomux_close(iomux, fd);
+    if (unlocked)
+        MUTEX_LOCK(iomux);
+
+    int taken = iomux_input_state.taken;
+    iomux_input_state.iomux = prev_iomux;
+    iomux_input_state.data = prev_data;
+    iomux_input_state.len = prev_len;
+    iomux_input_state.fd = prev_fd;
+    iomux_input_state.taken = 0;
+
+    if (iomux->connections[fd] != conn)
+        return 0;
+
+    // the buffer now belongs to the application,
+    // all the data it holds is considered consumed
+    if (taken) {
+        iomux_input_check_full(iomux, conn);
+        return 1;
+    }
+
+    int left = (mb >= len) ? 0 : len - (mb > 0 ? mb : 0);
+    if (data == conn->inbuf) {
+        if (left && left < len)
+            memmove(conn->inbuf, conn->inbuf + len - left, left);
+        conn->inlen = left;
+    } else if (left) {
+        // keep only what has not been consumed in the connection buffer
+        if (iomux_inbuf_reserve(iomux, conn, left)) {
+            memcpy(conn->inbuf, data + len - left, left);
+            conn->inlen = left;
         }
-    } else if (rb == 0) {
-         iomux_close(iomux, fd);
-    } else {
-        conn->inlen += rb;
-         if (mux_input) {
-             int len = conn->inlen;
-             int mb = mux_input(iomux, fd, conn->inbuf, len, priv);
-             if (iomux->connections[fd] == conn && iomux->connections[fd]->inlen == conn->inlen)
-             {
-                 if (mb == conn->inlen) {
-                     conn->inlen = 0;
-                 } else if (mb) {
-                     memmove(conn->inbuf, conn->inbuf + mb, len - mb);
-                     conn->inlen -= mb;
-                 }
-             }
-         }
     }
-    MUTEX_UNLOCK(iomux);
+
+    // give the buffer back as soon as everything has been consumed
+    // (buffers grown to retain the overflow are never kept around)
+    if (!conn->inlen && conn->inbuf && (iomux->inbuf_pool_size || conn->bufsize != iomux->bufsize)) {
+        iomux_inbuf_put(iomux, conn->inbuf, conn->bufsize);
+        conn->inbuf = NULL;
+    }
+    iomux_input_check_full(iomux, conn);
+    return 1;
 }
 
 static void
-iomux_write_fd(iomux_t *iomux, int fd, void *priv)
+iomux_read_datagrams(iomux_t *iomux, iomux_connection_t *conn)
 {
-    MUTEX_LOCK(iomux);
+    int fd = conn->fd;
+    int lens[IOMUX_DATAGRAM_BATCH];
+    socklen_t addrlens[IOMUX_DATAGRAM_BATCH];
+    int i, n;
+
+    if (!iomux->dgram) {
+        iomux->dgram = malloc(sizeof(iomux_datagram_batch_t) + IOMUX_DATAGRAM_BATCH * iomux->bufsize);
+        if (!iomux->dgram) {
+            set_error(iomux, "Can't allocate memory for the datagram buffers: %s", strerror(errno));
+            return;
+        }
+    }
+    iomux_datagram_batch_t *batch = iomux->dgram;
 
-    iomux_output_chunk_t *chunk = TAILQ_FIRST(&iomux->connections[fd]->output_queue);
-    if (!iomux->connections[fd] || !chunk) {
-#if defined(HAVE_EPOLL)
-            MUTEX_UNLOCK(iomux);
-            // let's unregister this fd from EPOLLOUT events (seems nothing needs to be sent anymore)
-            struct epoll_event event;
-            bzero(&event, sizeof(event));
-            event.data.fd = fd;
-            event.events = EPOLLIN;
-
-            int rc = epoll_ctl(iomux->efd, EPOLL_CTL_MOD, fd, &event);
-            if (rc == -1) {
-                fprintf(stderr, "Errors modifying fd %d on epoll instance %d : %s\n",
-                        fd, iomux->efd, strerror(errno));
-            }
-#elif defined(HAVE_KQUEUE)
-        EV_SET(&iomux->connections[fd]->event[1], fd, iomux->connections[fd]->kfilters[1], EV_DELETE | EV_ONESHOT, 0, 0, 0);
-        MUTEX_UNLOCK(iomux);
+#if defined(HAVE_MMSG)
+    for (i = 0; i < IOMUX_DATAGRAM_BATCH; i++) {
+        batch->iov[i].iov_base = batch->data + (i * iomux->bufsize);
+        batch->iov[i].iov_len = iomux->bufsize;
+        memset(&batch->msgs[i], 0, sizeof(struct mmsghdr));
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    }
+    n = recvmmsg(fd, batch->msgs, IOMUX_DATAGRAM_BATCH, 0, NULL);
+    for (i = 0; i < n; i++) {
+        lens[i] = batch->msgs[i].msg_len;
+        addrlens[i] = batch->msgs[i].msg_hdr.msg_namelen;
+    }
+#else
+    for (n = 0; n < IOMUX_DATAGRAM_BATCH; n++) {
+        addrlens[n] = sizeof(struct sockaddr_storage);
+        lens[n] = recvfrom(fd, batch->data + (n * iomux->bufsize), iomux->bufsize, 0,
+                           (struct sockaddr *)&batch->addrs[n], &addrlens[n]);
+        if (lens[n] == -1)
+            break;
+    }
+    if (!n)
+        n = -1;
 #endif
+
+    if (n == -1) {
+        // NOTE: ECONNREFUSED is reported on connected sockets
+        //       if a previously sent datagram has been refused
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+            if (errno != EBADF)
+                fprintf(stderr, "recv on fd %d failed: %s\n", fd, strerror(errno));
+            iomux_close(iomux, fd);
+        }
         return;
     }
 
-    char *outbuf = (char *)chunk->data + chunk->offset;
-    int outlen = chunk->len - chunk->offset;
-
-    MUTEX_UNLOCK(iomux);
+    for (i = 0; i < n; i++) {
+        conn->cbs.mux_datagram(iomux, fd, batch->data + (i * iomux->bufsize), lens[i],
+                               (struct sockaddr *)&batch->addrs[i], addrlens[i], conn->cbs.priv);
+        // the callback might have removed the fd from the mux
+        if (iomux->connections[fd] != conn || !conn->cbs.mux_datagram)
+            break;
+    }
+}
 
-    int wb = write(fd, outbuf, outlen);
-    if (wb <= 0) {
-        if (errno != EINTR && errno != EAGAIN) {
-            fprintf(stderr, "write on fd %d failed: %s\n", fd, strerror(errno));
+// NOTE - on a oneshot mux this is entered without holding the lock (see
+//        iomux_oneshot_dispatch()), so the lock taken here is the only one and
+//        iomux_input_deliver() can release it completely while running mux_input
+static void
+iomux_read_fd(iomux_t *iomux, int fd, iomux_input_callback_t mux_input, void *priv)
+{
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *conn = iomux->connections[fd];
+
+    if (conn->cbs.mux_readable) {
+        // raw mode, the application will read from the fd itself
+        conn->cbs.mux_readable(iomux, fd, conn->cbs.priv);
+        MUTEX_UNLOCK(iomux);
+        return;
+    }
+
+    if (conn->cbs.mux_datagram) {
+        iomux_read_datagrams(iomux, conn);
+        MUTEX_UNLOCK(iomux);
+        return;
+    }
+
+    if (conn->inbuf && conn->inlen >= conn->bufsize) {
+        // stop polling for input until the application consumes some data
+        conn->flags |= IOMUX_CONNECTION_INPUT_FULL;
+        iomux_input_interest(iomux, conn);
+        MUTEX_UNLOCK(iomux);
+        return;
+    }
+
+    // NOTE: The overflow buffer is used to read everything available in a
+    //       single syscall. It starts with bufsize bytes of headroom where
+    //       the (full) connection buffer is copied if the read spills over
+    //       it, so that the callback can be given contiguous data
+    //       Oneshot muxes don't use it since it would be shared by the threads
+    int use_overflow = (mux_input && iomux->overflow_size && !iomux->oneshot &&
+                        (!conn->inbuf || conn->bufsize <= iomux->bufsize));
+    if (use_overflow && !iomux->overflow) {
+        iomux->overflow = malloc(iomux->bufsize + iomux->overflow_size);
+        use_overflow = (iomux->overflow != NULL);
+    }
+
+    if (!use_overflow && !iomux_inbuf_reserve(iomux, conn, 0)) {
+        MUTEX_UNLOCK(iomux);
+        return;
+    }
+
+    struct iovec iov[2];
+    int iovcnt = 0;
+    int avail = 0;
+    int prefix = 0;
+    if (conn->inbuf) {
+        avail = conn->bufsize - conn->inlen;
+        prefix = conn->bufsize;
+        iov[iovcnt].iov_base = conn->inbuf + conn->inlen;
+        iov[iovcnt].iov_len = avail;
+        iovcnt++;
+    }
+    if (use_overflow) {
+        iov[iovcnt].iov_base = iomux->overflow + prefix;
+        iov[iovcnt].iov_len = iomux->overflow_size;
+        iovcnt++;
+    }
+
+    int rb = readv(fd, iov, iovcnt);
+
+    if (rb == -1) {
+        if (errno != EINTR && errno != EAGAIN) {
+            // don't output warnings if the filedescriptor has been closed
+            // without informing the iomux or if the connection has been
+            // dropped by the peer
+            if (errno != EBADF && errno != ECONNRESET)
+                fprintf(stderr, "read on fd %d failed: %s\n", fd, strerror(errno));
             iomux_close(iomux, fd);
         }
+    } else if (rb == 0) {
+         iomux_close(iomux, fd);
+    } else if (rb <= avail) {
+        conn->inlen += rb;
+        if (mux_input)
+            iomux_input_deliver(iomux, conn, conn->inbuf, conn->inlen, mux_input, priv);
     } else {
-        MUTEX_LOCK(iomux);
-        outlen -= wb;
-        if (!outlen) {
-            TAILQ_REMOVE(&iomux->connections[fd]->output_queue, chunk, next); 
-            if (chunk->free) {
-                if (iomux->connections[fd]->cbs.mux_free_data)
-                    iomux->connections[fd]->cbs.mux_free_data(iomux, fd, chunk->data, chunk->len, iomux->connections[fd]->cbs.priv);
-                else
-                    free(chunk->data);
-            }
-            free(chunk);
-            chunk = TAILQ_FIRST(&iomux->connections[fd]->output_queue);
-        } else {
-            chunk->offset += wb;
-        }
-        if (!chunk) {
+        if (prefix)
+            memcpy(iomux->overflow, conn->inbuf, prefix);
+        conn->inlen = 0;
+        iomux_input_deliver(iomux, conn, iomux->overflow, prefix + rb - avail, mux_input, priv);
+    }
+
+    // a pooled buffer which is still empty (nothing has been read)
+    // can go back to the pool straight away
+    if (iomux->connections[fd] == conn && conn->inbuf && !conn->inlen && iomux->inbuf_pool_size) {
+        iomux_inbuf_put(iomux, conn->inbuf, conn->bufsize);
+        conn->inbuf = NULL;
+    }
+    MUTEX_UNLOCK(iomux);
+}
+
+// NOTE - called when there is nothing left to send on conn
+static void
+iomux_output_done(iomux_t *iomux, iomux_connection_t *conn)
+{
 #if defined(HAVE_EPOLL)
-            // let's unregister this fd from EPOLLOUT events (seems nothing needs to be sent anymore)
-            struct epoll_event event = { 0 };
-            event.data.fd = fd;
-            event.events = EPOLLIN;
-
-            int rc = epoll_ctl(iomux->efd, EPOLL_CTL_MOD, fd, &event);
-            if (rc == -1) {
-                fprintf(stderr, "Errors modifying fd %d on epoll instance %d : %s\n",
-                        fd, iomux->efd, strerror(errno));
-            }
+    // let's unregister this fd from EPOLLOUT events (seems nothing needs to be sent anymore)
+    if (!iomux_epoll_update(iomux, conn, 0)) {
+        fprintf(stderr, "Errors modifying fd %d on epoll instance %d : %s\n",
+                conn->fd, iomux->efd, strerror(errno));
+    }
+#elif defined(HAVE_KQUEUE)
+    EV_SET(&conn->event[1], conn->fd, conn->kfilters[1], EV_DELETE | EV_ONESHOT, 0, 0, 0);
+#endif
+}
+
+// NOTE - called when there is new data to send on conn
+static int
+iomux_output_pending(iomux_t *iomux, iomux_connection_t *conn)
+{
+#if defined(HAVE_EPOLL)
+    if (!iomux_epoll_update(iomux, conn, 1))
+        return 0;
 #elif defined(HAVE_KQUEUE)
-            EV_SET(&iomux->connections[fd]->event[1], fd, iomux->connections[fd]->kfilters[1], EV_DELETE | EV_ONESHOT, 0, 0, 0);
+    EV_SET(&conn->event[1], conn->fd, conn->kfilters[1], EV_ADD | EV_ONESHOT, 0, 0, 0);
+#endif
+    return 1;
+}
+
+// NOTE - returns how many bytes can be sent on conn right now (-1 if the
+//        output is not paced), if none the wakeup time is updated so that
+//        the output is resumed when enough tokens have been collected
+static int
+iomux_pacing_allowance(iomux_connection_t *conn, iomux_output_chunk_t *chunk)
+{
+    if (!conn->pacing_rate)
+        return -1;
+
+    struct timeval now, elapsed;
+    gettimeofday(&now, NULL);
+    timersub(&now, &conn->pacing_last, &elapsed);
+    if (elapsed.tv_sec >= 10) {
+        conn->pacing_tokens = conn->pacing_burst;
+        memcpy(&conn->pacing_last, &now, sizeof(now));
+    } else {
+        int64_t refill = conn->pacing_rate * (elapsed.tv_sec * 1000000 + elapsed.tv_usec) / 1000000;
+        // NOTE: the time is accounted only once some tokens have been
+        //       collected, otherwise frequent calls would never refill
+        if (refill > 0) {
+            conn->pacing_tokens += refill;
+            memcpy(&conn->pacing_last, &now, sizeof(now));
+        }
+        if (conn->pacing_tokens > conn->pacing_burst)
+            conn->pacing_tokens = conn->pacing_burst;
+    }
+
+    if (conn->pacing_tokens > 0)
+        return conn->pacing_tokens > INT_MAX ? INT_MAX : conn->pacing_tokens;
+
+    // wait until the next chunk fits in the bucket (or the bucket is full)
+    int64_t needed = chunk->len - chunk->offset;
+    if (needed > conn->pacing_burst)
+        needed = conn->pacing_burst;
+    int64_t wait = (needed - conn->pacing_tokens) * 1000000 / conn->pacing_rate + 1;
+    struct timeval delay = { wait / 1000000, wait % 1000000 };
+    timeradd(&now, &delay, &conn->pacing_wakeup);
+    return 0;
+}
+
+static void
+iomux_write_datagrams(iomux_t *iomux, iomux_connection_t *conn, int allowance)
+{
+    int fd = conn->fd;
+    iomux_output_chunk_t *chunks[IOMUX_DATAGRAM_BATCH];
+    iomux_output_chunk_t *chunk;
+    int i, n = 0;
+
+    int batch_len = 0;
+    TAILQ_FOREACH(chunk, &conn->output_queue, next) {
+        if (n == IOMUX_DATAGRAM_BATCH)
+            break;
+        // NOTE: when pacing, the first datagram is always sent (possibly
+        //       going in debt with the token bucket)
+        if (allowance > 0 && n && batch_len + chunk->len > allowance)
+            break;
+        batch_len += chunk->len;
+        chunks[n++] = chunk;
+    }
+
+    int sent = 0;
+#if defined(HAVE_MMSG)
+    struct mmsghdr msgs[IOMUX_DATAGRAM_BATCH];
+    struct iovec iov[IOMUX_DATAGRAM_BATCH];
+    memset(msgs, 0, sizeof(struct mmsghdr) * n);
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = chunks[i]->data;
+        iov[i].iov_len = chunks[i]->len;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = chunks[i]->addr;
+        msgs[i].msg_hdr.msg_namelen = chunks[i]->addrlen;
+    }
+    sent = sendmmsg(fd, msgs, n, 0);
+#else
+    for (sent = 0; sent < n; sent++) {
+        if (sendto(fd, chunks[sent]->data, chunks[sent]->len, 0, chunks[sent]->addr, chunks[sent]->addrlen) == -1)
+            break;
+    }
+    if (!sent)
+        sent = -1;
+#endif
+
+    if (sent == -1) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        if (errno == EBADF) {
+            iomux_close(iomux, fd);
+            return;
+        }
+        // the first datagram can't be sent (too big, unreachable destination, ...)
+        // there is no point in retrying so it's dropped
+        fprintf(stderr, "send on fd %d failed: %s\n", fd, strerror(errno));
+        sent = 1;
+    }
+
+    for (i = 0; i < sent; i++) {
+        if (conn->pacing_rate)
+            conn->pacing_tokens -= chunks[i]->len;
+        iomux_output_dequeue(iomux, conn, chunks[i]);
+    }
+
+    if (TAILQ_EMPTY(&conn->output_queue))
+        iomux_output_done(iomux, conn);
+
+    iomux_output_watermarks(iomux, conn);
+}
+
+// NOTE - estimates how many bytes can be provided by mux_output
+//        (0 if no hint has been configured for conn)
+static int
+iomux_output_space(iomux_connection_t *conn)
+{
+    if (!conn->output_hint)
+        return 0;
+
+    int space = conn->output_hint;
+    if (conn->output_hint == IOMUX_OUTPUT_HINT_KERNEL) {
+        int sndbuf = 0;
+        socklen_t optlen = sizeof(sndbuf);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen) != 0)
+            return 0;
+        space = sndbuf;
+#if defined(SIOCOUTQ)
+        // subtract what is still in the kernel send queue
+        int outq = 0;
+        if (ioctl(conn->fd, SIOCOUTQ, &outq) == 0)
+            space -= outq;
+#endif
+    }
+    space -= conn->output_len;
+    return space > 0 ? space : 0;
+}
+
+// NOTE - asks the application for more output through the mux_output callback
+//        returns 1 if a chunk has been queued, 0 if not and -1 if
+//        the connection has been removed from the mux
+static int
+iomux_output_fetch(iomux_t *iomux, iomux_connection_t *connection)
+{
+    int fd = connection->fd;
+
+    // NOTE: when rejecting writes over budget we don't even ask for more output
+    if (iomux->budget_policy == IOMUX_BUDGET_POLICY_REJECT && iomux_output_budget_exceeded(iomux, 0))
+        return 0;
+
+    int len = iomux_output_space(connection);
+    // NOTE: with a hint configured, a len of 0 means that fd can't
+    //       accept anything right now, there is no point in asking
+    if (connection->output_hint && !len)
+        return 0;
+
+    unsigned char *data = NULL;
+    int mode = connection->cbs.mux_output(iomux, fd, &data, &len, connection->cbs.priv);
+
+    // NOTE: the output callback might have removed the fd from the mux
+    if (!iomux->connections[fd]) {
+        free(data);
+        return -1;
+    }
+
+    if (!data)
+        return 0;
+
+    iomux_output_chunk_t *chunk = iomux_chunk_create(iomux, data, len, mode);
+    if (!chunk) {
+        if (mode == IOMUX_OUTPUT_MODE_FREE)
+            iomux_free_data(iomux, fd, connection->cbs.mux_free_data, connection->cbs.priv, data, len);
+        return 0;
+    }
+    iomux_output_enqueue(iomux, connection, chunk);
+    if (iomux_output_budget_exceeded(iomux, 0)) {
+        if (iomux->budget_cb)
+            iomux->budget_cb(iomux, iomux->budget_priv);
+        if (iomux->connections[fd] != connection)
+            return -1;
+        if (iomux_output_budget_exceeded(iomux, 0))
+            iomux_output_budget_apply(iomux);
+        if (TAILQ_EMPTY(&connection->output_queue))
+            return 0;
+    }
+    iomux_output_watermarks(iomux, connection);
+    if (iomux->connections[fd] != connection)
+        return -1;
+    return 1;
+}
+
+static void
+iomux_write_fd(iomux_t *iomux, int fd, void *priv)
+{
+    MUTEX_LOCK(iomux);
+
+    iomux_connection_t *conn = iomux->connections[fd];
+    iomux_output_chunk_t *chunk = conn ? TAILQ_FIRST(&conn->output_queue) : NULL;
+    if (!chunk && conn && (conn->flags & IOMUX_CONNECTION_OUTPUT_WANTED) && conn->cbs.mux_output) {
+        // the application has some data for us now that fd is writable
+        conn->flags &= ~IOMUX_CONNECTION_OUTPUT_WANTED;
+        if (iomux_output_fetch(iomux, conn) == -1) {
+            MUTEX_UNLOCK(iomux);
+            return;
+        }
+        chunk = TAILQ_FIRST(&conn->output_queue);
+    }
+    if (!chunk) {
+        if (conn)
+            iomux_output_done(iomux, conn);
+        MUTEX_UNLOCK(iomux);
+        return;
+    }
+
+    if (conn->flags & IOMUX_CONNECTION_CORKED) {
+        // nothing will be sent until iomux_uncork() is called
+        iomux_output_done(iomux, conn);
+        MUTEX_UNLOCK(iomux);
+        return;
+    }
+
+    int allowance = iomux_pacing_allowance(conn, chunk);
+    if (!allowance) {
+        // nothing will be sent until the token bucket refills
+        // (see iomux_poll_connection())
+        iomux_output_done(iomux, conn);
+        MUTEX_UNLOCK(iomux);
+        return;
+    }
+
+    if (conn->cbs.mux_datagram) {
+        iomux_write_datagrams(iomux, conn, allowance);
+        MUTEX_UNLOCK(iomux);
+        return;
+    }
+
+    struct iovec iov[IOMUX_WRITEV_MAX];
+    int iovcnt = 0;
+    int more = 0;
+    while (chunk && iovcnt < IOMUX_WRITEV_MAX) {
+        iov[iovcnt].iov_base = chunk->data + chunk->offset;
+        iov[iovcnt].iov_len = chunk->len - chunk->offset;
+        chunk = TAILQ_NEXT(chunk, next);
+        if (allowance > 0 && iov[iovcnt].iov_len >= allowance) {
+            more = (chunk || iov[iovcnt].iov_len > allowance);
+            iov[iovcnt++].iov_len = allowance;
+            break;
+        }
+        if (allowance > 0)
+            allowance -= iov[iovcnt].iov_len;
+        iovcnt++;
+        more = (chunk != NULL);
+    }
+
+    // NOTE: the lock is retained while writing (the fd is non-blocking anyway)
+    //       since the iovecs point to chunks which might be released otherwise
+    int wb = -1;
+#if defined(MSG_MORE)
+    if (!(conn->flags & IOMUX_CONNECTION_NOTSOCK)) {
+        // let the kernel know if more data is going to follow
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        wb = sendmsg(fd, &msg, more ? MSG_MORE : 0);
+        if (wb == -1 && errno == ENOTSOCK)
+            conn->flags |= IOMUX_CONNECTION_NOTSOCK;
+    }
+    if (conn->flags & IOMUX_CONNECTION_NOTSOCK)
 #endif
+    wb = writev(fd, iov, iovcnt);
+
+    if (wb == -1) {
+        if (errno != EINTR && errno != EAGAIN) {
+            fprintf(stderr, "write on fd %d failed: %s\n", fd, strerror(errno));
+            iomux_close(iomux, fd);
         }
         MUTEX_UNLOCK(iomux);
+        return;
+    }
+
+    if (conn->pacing_rate)
+        conn->pacing_tokens -= wb;
+
+    chunk = TAILQ_FIRST(&conn->output_queue);
+    while (chunk) {
+        int left = chunk->len - chunk->offset;
+        if (wb < left) {
+            iomux_output_advance(iomux, conn, chunk, wb);
+            break;
+        }
+        wb -= left;
+        iomux_output_dequeue(iomux, conn, chunk);
+        chunk = TAILQ_FIRST(&conn->output_queue);
     }
+    if (!chunk)
+        iomux_output_done(iomux, conn);
+
+    iomux_output_watermarks(iomux, conn);
+    MUTEX_UNLOCK(iomux);
 }
 
 static struct timeval *
@@ -757,17 +2020,21 @@ iomux_adjust_timeout(iomux_t *iomux, struct timeval *tv_default)
     iomux_timeout_t *timeout = NULL;
     void *timeout_ptr = NULL;
     uint64_t key = 0;
+    TIMERS_LOCK(iomux);
     bh_minimum(iomux->timeouts, &key, &timeout_ptr, NULL);
     timeout = (iomux_timeout_t *)timeout_ptr;
 
-    if (!timeout)
+    if (!timeout) {
+        TIMERS_UNLOCK(iomux);
         return tv_default;
+    }
 
     struct timeval wait_time = { 0, 0 };
     struct timeval now;
     gettimeofday(&now, NULL);
     if (timercmp(&timeout->expire_time, &now, >))
         timersub(&timeout->expire_time, &now, &wait_time);
+    TIMERS_UNLOCK(iomux);
 
     if (tv_default && timeout) {
         if (timercmp(&wait_time, tv_default, >))
@@ -790,20 +2057,30 @@ iomux_run_timeouts(iomux_t *iomux)
 {
     iomux_timeout_t *timeout = NULL;
 
-    MUTEX_LOCK(iomux);
+    TIMERS_LOCK(iomux);
+    int count = bh_count(iomux->timeouts);
+    TIMERS_UNLOCK(iomux);
 
-    if (!bh_count(iomux->timeouts)) {
+    if (!count) {
         // there are no timeouts scheduled,
         // return early
-        MUTEX_UNLOCK(iomux);
         return;
     }
 
+    // NOTE: the callbacks are run holding the mux lock (as any other callback)
+    //       but not the timers lock, so that they can schedule new timers
+    MUTEX_LOCK(iomux);
+
     struct timeval now;
     gettimeofday(&now, NULL);
 
     void *timeout_ptr = NULL;
-    while (bh_delete_minimum(iomux->timeouts, &timeout_ptr, NULL) == 0) {
+    for (;;) {
+        TIMERS_LOCK(iomux);
+        if (bh_delete_minimum(iomux->timeouts, &timeout_ptr, NULL) != 0) {
+            TIMERS_UNLOCK(iomux);
+            break;
+        }
         timeout = (iomux_timeout_t *)timeout_ptr;
         if (timercmp(&now, &timeout->expire_time, <)) {
             if (bh_insert(iomux->timeouts,
@@ -813,34 +2090,58 @@ iomux_run_timeouts(iomux_t *iomux)
             {
                 fprintf(stderr, "%s: Can't insert a new node in the binomial heap\n", __FUNCTION__);
             }
+            TIMERS_UNLOCK(iomux);
             break;
         }
+        iomux->running_timer = timeout->id;
+        iomux->running_cb = timeout->cb;
+        iomux->running_priv = timeout->priv;
+        iomux->running_thread = pthread_self();
+        TIMERS_UNLOCK(iomux);
+
         // run expired timeouts
         timeout->cb(iomux, timeout->priv);
         iomux_timeout_destroy(timeout);
+
+        TIMERS_LOCK(iomux);
+        iomux->running_timer = 0;
+        if (iomux->timers_cond)
+            pthread_cond_broadcast(iomux->timers_cond);
+        TIMERS_UNLOCK(iomux);
     }
 
     MUTEX_UNLOCK(iomux);
 }
 
-void
-iomux_loop(iomux_t *iomux, struct timeval *tv)
+int
+iomux_loop_once(iomux_t *iomux, struct timeval *tv)
 {
-    struct timeval tv_default = { 0, 20000 };
-    while (!iomux->leave) {
+    if (!iomux->leave) {
         if (iomux->loop_next_cb)
             iomux->loop_next_cb(iomux, iomux->loop_end_priv);
 
-        iomux_run(iomux, tv ? tv : &tv_default);
+        iomux_run(iomux, tv);
 
         if (iomux_hangup && iomux->hangup_cb)
             iomux->hangup_cb(iomux, iomux->hangup_priv);
+
+        if (!iomux->leave)
+            return 1;
     }
 
     if (iomux->loop_end_cb)
         iomux->loop_end_cb(iomux, iomux->loop_end_priv);
 
     iomux->leave = 0;
+    return 0;
+}
+
+void
+iomux_loop(iomux_t *iomux, struct timeval *tv)
+{
+    struct timeval tv_default = { 0, 20000 };
+    while (iomux_loop_once(iomux, tv ? tv : &tv_default))
+        ;
 }
 
 void
@@ -852,84 +2153,411 @@ iomux_end_loop(iomux_t *iomux)
 int
 iomux_write(iomux_t *iomux, int fd, unsigned char *buf, int len, int mode)
 {
-    iomux_output_chunk_t *chunk = calloc(1, sizeof(iomux_output_chunk_t));
-    if (!chunk) {
-        set_error(iomux, "%s: Can't allocate memory for the new chunk", __FUNCTION__, strerror(errno));
-        return 0;
-    }
-    chunk->free = (mode != IOMUX_OUTPUT_MODE_NONE);
-    if (mode == IOMUX_OUTPUT_MODE_COPY) {
-        chunk->data = malloc(len);
-        if (!chunk->data) {
-            set_error(iomux, "%s: Can't allocate memory for the chunk data", __FUNCTION__, strerror(errno));
-            free(chunk);
-            return 0;
-        }
-        memcpy(chunk->data, buf, len);
-    } else {
-        // TODO - check for unknown output modes
-        chunk->data = buf;
-    }
-    chunk->len = len;
+    return iomux_sendto(iomux, fd, buf, len, mode, NULL, 0);
+}
 
-    MUTEX_LOCK(iomux);
+// NOTE - returns the queued chunk holding an update for key
+//        which hasn't been (even partially) written yet
+static iomux_output_chunk_t *
+iomux_output_find_key(iomux_connection_t *conn, uint64_t key)
+{
+    iomux_output_chunk_t *chunk;
+    TAILQ_FOREACH(chunk, &conn->output_queue, next) {
+        if (chunk->keyed && chunk->key == key && !chunk->offset)
+            return chunk;
+    }
+    return NULL;
+}
 
-    if (!iomux->connections[fd]) {
-        MUTEX_UNLOCK(iomux);
-        if (chunk->free) {
-            if (iomux->connections[fd]->cbs.mux_free_data)
-                iomux->connections[fd]->cbs.mux_free_data(iomux, fd, chunk->data, chunk->len, iomux->connections[fd]->cbs.priv);
-            else
-                free(chunk->data);
+// NOTE - checks the output budget before queueing len bytes on fd.
+//        Returns -1 if nothing can be queued (the budget has been exceeded
+//        with the REJECT policy or the budget callback removed fd),
+//        1 if the budget is exceeded and the policy has to be applied, 0 otherwise
+static int
+iomux_output_admit(iomux_t *iomux, int fd, int len)
+{
+    int exceeded = iomux_output_budget_exceeded(iomux, len);
+    if (exceeded) {
+        if (iomux->budget_cb)
+            iomux->budget_cb(iomux, iomux->budget_priv);
+        // NOTE: the callback might have released some output (or removed fd)
+        if (!iomux->connections[fd])
+            return -1;
+        exceeded = iomux_output_budget_exceeded(iomux, len);
+        if (exceeded && iomux->budget_policy == IOMUX_BUDGET_POLICY_REJECT) {
+            set_error(iomux, "%s: Output budget of %zu bytes exceeded", __FUNCTION__, iomux->output_budget);
+            return -1;
         }
-        free(chunk);
-        return 0;
     }
+    return exceeded;
+}
 
-    TAILQ_INSERT_TAIL(&iomux->connections[fd]->output_queue, chunk, next);
-
-#if defined(HAVE_EPOLL)
-    struct epoll_event event;
-    bzero(&event, sizeof(event));
-    event.data.fd = fd;
-    event.events = EPOLLIN | EPOLLOUT;
+// NOTE - called once a new chunk has been queued on fd,
+//        returns FALSE if fd can't be registered for output
+static int
+iomux_output_commit(iomux_t *iomux, int fd, int exceeded)
+{
+    if (exceeded) {
+        iomux_output_budget_apply(iomux);
+        // NOTE: the chunk we just queued might have been dropped as well
+        if (TAILQ_EMPTY(&iomux->connections[fd]->output_queue))
+            return 1;
+    }
 
-    int rc = epoll_ctl(iomux->efd, EPOLL_CTL_MOD, fd, &event);
-    if (rc == -1) {
-        MUTEX_UNLOCK(iomux);
+    // NOTE: corked connections will be registered for output events by iomux_uncork()
+    if (!(iomux->connections[fd]->flags & IOMUX_CONNECTION_CORKED) &&
+        !iomux_output_pending(iomux, iomux->connections[fd]))
+    {
         if (errno == EBADF) {
             iomux_close(iomux, fd);
         } else {
-            fprintf(stderr, "Errors modifying fd %d to epoll instance %d : %s\n",
-                    fd, iomux->efd, strerror(errno));
+            fprintf(stderr, "Errors modifying fd %d to epoll instance : %s\n",
+                    fd, strerror(errno));
         }
         return 0;
     }
-#elif defined(HAVE_KQUEUE)
-    EV_SET(&iomux->connections[fd]->event[1], fd, iomux->connections[fd]->kfilters[1], EV_ADD | EV_ONESHOT, 0, 0, 0);
-#endif
 
-    MUTEX_UNLOCK(iomux);
-    return len;
+    iomux_output_watermarks(iomux, iomux->connections[fd]);
+    return 1;
 }
 
-int
-iomux_close(iomux_t *iomux, int fd)
+// NOTE - doesn't take the lock, returns FALSE if fd is not registered
+//        with the given generation (anymore). Seqlock-like: the slot is
+//        valid only if the generation didn't change while reading it
+static int
+iomux_free_slot_get(iomux_t *iomux, int fd, uint32_t generation, iomux_free_slot_t *slot)
 {
-    MUTEX_LOCK(iomux);
-
-    iomux_connection_t *conn = iomux->connections[fd];
-    if (!conn) { // fd is not registered within iomux
-        MUTEX_UNLOCK(iomux);
+    if (fd < 0 || fd >= iomux->maxconnections || !generation ||
+        __atomic_load_n(&iomux->generations[fd], __ATOMIC_ACQUIRE) != generation)
+    {
         return 0;
     }
+    slot->cb = __atomic_load_n(&iomux->free_slots[fd].cb, __ATOMIC_RELAXED);
+    slot->priv = __atomic_load_n(&iomux->free_slots[fd].priv, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&iomux->generations[fd], __ATOMIC_RELAXED) == generation);
+}
+
+static int
+iomux_async_push(iomux_t *iomux, iomux_conn_id_t id, unsigned char *buf, int len, int mode, int priority)
+{
+    if (len <= 0)
+        return 0;
+
+    // NOTE: a chunk for a connection which is already gone is refused right away,
+    //       otherwise it keeps how to release the data in case it's dropped later
+    iomux_free_slot_t slot;
+    if (!iomux_free_slot_get(iomux, (int)(id & 0xffffffff), (uint32_t)(id >> 32), &slot))
+        return 0;
+
+    // NOTE: the chunk doesn't come from the chunk cache, which belongs to the loop thread
+    iomux_output_chunk_t *chunk = iomux_chunk_alloc(len, mode);
+    if (!chunk)
+        return 0;
+    iomux_chunk_fill(chunk, buf, len, mode);
+    chunk->priority = priority;
+    chunk->free_cb = slot.cb;
+    chunk->free_priv = slot.priv;
+
+    // NOTE: until the loop thread takes it, the chunk carries the connection id
+    //       in the key and is linked to the stack through its queue entry
+    chunk->key = id;
+    TAILQ_NEXT(chunk, next) = __atomic_load_n(&iomux->async_writes, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&iomux->async_writes, &TAILQ_NEXT(chunk, next), chunk, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    if (!TAILQ_NEXT(chunk, next))
+        iomux_wakeup(iomux);
+    return len;
+}
+
+// NOTE - releases a chunk written with iomux_write_async() which can't be queued
+//        through the mux_free_data callback of the connection it was written to
+static void
+iomux_async_drop(iomux_t *iomux, int fd, iomux_output_chunk_t *chunk)
+{
+    if (chunk->free)
+        iomux_free_data(iomux, fd, chunk->free_cb, chunk->free_priv, chunk->data, chunk->len);
+    free(chunk);
+}
+
+// NOTE - moves the chunks written by other threads to the output queues
+//        of their connections. Chunks addressed to a connection which
+//        has been closed (even if the fd has been reused since) are dropped
+static void
+iomux_run_async_writes(iomux_t *iomux)
+{
+    if (!__atomic_load_n(&iomux->async_writes, __ATOMIC_ACQUIRE))
+        return;
+
+    iomux_output_chunk_t *chunk = __atomic_exchange_n(&iomux->async_writes, NULL, __ATOMIC_ACQ_REL);
+    iomux_output_chunk_t *fifo = NULL;
+    while (chunk) {
+        iomux_output_chunk_t *next = TAILQ_NEXT(chunk, next);
+        TAILQ_NEXT(chunk, next) = fifo;
+        fifo = chunk;
+        chunk = next;
+    }
+
+    while (fifo) {
+        chunk = fifo;
+        fifo = TAILQ_NEXT(chunk, next);
+
+        int fd = (int)(chunk->key & 0xffffffff);
+        uint32_t generation = (uint32_t)(chunk->key >> 32);
+        chunk->key = 0;
+
+        iomux_connection_t *conn = fd < iomux->maxconnections ? iomux->connections[fd] : NULL;
+        if (!conn || conn->generation != generation) {
+            iomux_async_drop(iomux, fd, chunk);
+            continue;
+        }
+
+        int exceeded = iomux_output_admit(iomux, fd, chunk->len);
+        if (exceeded < 0) {
+            if (iomux->connections[fd])
+                iomux_chunk_destroy(iomux, iomux->connections[fd], chunk);
+            else
+                iomux_async_drop(iomux, fd, chunk);
+            continue;
+        }
+
+        iomux_output_enqueue(iomux, conn, chunk);
+        iomux_output_commit(iomux, fd, exceeded);
+    }
+}
+
+// NOTE - hands a write to the loop thread without taking the lock.
+//        The chunk is bound to the connection currently registered for fd,
+//        so it can't reach a new connection if the fd is closed and reused
+static int
+iomux_queue_async(iomux_t *iomux, int fd, unsigned char *buf, int len, int mode, int priority)
+{
+    // NOTE: if fd is not registered within iomux the caller keeps the data
+    uint32_t generation = __atomic_load_n(&iomux->generations[fd], __ATOMIC_ACQUIRE);
+    return iomux_async_push(iomux, ((iomux_conn_id_t)generation << 32) | (uint32_t)fd, buf, len, mode, priority);
+}
+
+static int
+iomux_queue_output(iomux_t *iomux, int fd, unsigned char *buf, int len, int mode,
+                   struct sockaddr *addr, socklen_t addrlen, int keyed, uint64_t key, int priority)
+{
+    // NOTE: writers don't wait for a mux busy dispatching events (possibly in a slow
+    //       callback), plain writes are handed to the loop thread instead.
+    //       The output budget can only be checked holding the lock, so with a budget
+    //       the writers wait as they always did
+    int handoff = (!addr && !keyed && fd >= 0 && fd < iomux->maxconnections &&
+                   !__atomic_load_n(&iomux->output_budget, __ATOMIC_RELAXED));
+    if (!MUTEX_TRYLOCK(iomux)) {
+        if (handoff)
+            return iomux_queue_async(iomux, fd, buf, len, mode, priority);
+        MUTEX_LOCK(iomux);
+    }
+
+    // NOTE: while there are writes handed over and not yet queued by the loop thread
+    //       the new ones follow the same way, so that each writer's data stays in order
+    if (handoff && __atomic_load_n(&iomux->async_writes, __ATOMIC_ACQUIRE)) {
+        MUTEX_UNLOCK(iomux);
+        return iomux_queue_async(iomux, fd, buf, len, mode, priority);
+    }
+
+    // NOTE: if fd is not registered within iomux the caller keeps the data
+    if (fd < 0 || fd >= iomux->maxconnections || !iomux->connections[fd]) {
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+    iomux_free_data_callback_t free_cb = iomux->connections[fd]->cbs.mux_free_data;
+    void *free_priv = iomux->connections[fd]->cbs.priv;
+
+    // NOTE: a keyed update replacing a queued one only adds the difference
+    //       to the output, a smaller one shrinks it and is always admitted
+    int added = len;
+    iomux_output_chunk_t *prev = keyed ? iomux_output_find_key(iomux->connections[fd], key) : NULL;
+    if (prev)
+        added -= prev->len;
+    int exceeded = (added > 0) ? iomux_output_admit(iomux, fd, added) : 0;
+    if (exceeded < 0) {
+        int removed = !iomux->connections[fd];
+        MUTEX_UNLOCK(iomux);
+        // NOTE: the caller still owns the data if the budget has been exceeded
+        if (removed && mode == IOMUX_OUTPUT_MODE_FREE)
+            iomux_free_data(iomux, fd, free_cb, free_priv, buf, len);
+        return 0;
+    }
+
+    // NOTE: the destination address is allocated before the chunk so that
+    //       a failure leaves the data untouched (and owned by the caller)
+    struct sockaddr *dest = NULL;
+    if (addr) {
+        dest = malloc(addrlen);
+        if (!dest) {
+            set_error(iomux, "%s: Can't allocate memory for the destination address: %s", __FUNCTION__, strerror(errno));
+            MUTEX_UNLOCK(iomux);
+            return 0;
+        }
+        memcpy(dest, addr, addrlen);
+    }
+
+    iomux_output_chunk_t *chunk = iomux_chunk_create(iomux, buf, len, mode);
+    if (!chunk) {
+        free(dest);
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+    chunk->addr = dest;
+    chunk->addrlen = dest ? addrlen : 0;
+    chunk->priority = priority;
+
+    // NOTE: the budget callback might have released the stale update already
+    if (prev)
+        prev = iomux_output_find_key(iomux->connections[fd], key);
+    if (prev && prev->priority == priority) {
+        // conflate: the new chunk takes the place of the stale one
+        iomux_connection_t *conn = iomux->connections[fd];
+        TAILQ_INSERT_AFTER(&conn->output_queue, prev, chunk, next);
+        conn->output_len += len;
+        iomux->output_total += len;
+        iomux_output_dequeue(iomux, conn, prev);
+    } else {
+        // the stale update is dropped, the new one is queued by its own priority
+        if (prev)
+            iomux_output_dequeue(iomux, iomux->connections[fd], prev);
+        iomux_output_enqueue(iomux, iomux->connections[fd], chunk);
+    }
+    chunk->keyed = keyed;
+    chunk->key = key;
+
+    int rc = iomux_output_commit(iomux, fd, exceeded);
+
+    MUTEX_UNLOCK(iomux);
+    return rc ? len : 0;
+}
+
+
+int
+iomux_sendto(iomux_t *iomux, int fd, unsigned char *buf, int len, int mode,
+             struct sockaddr *addr, socklen_t addrlen)
+{
+    return iomux_queue_output(iomux, fd, buf, len, mode, addr, addrlen, 0, 0, IOMUX_PRIORITY_NORMAL);
+}
+
+int
+iomux_write_priority(iomux_t *iomux, int fd, unsigned char *buf, int len, int mode, iomux_priority_t priority)
+{
+    if (priority < IOMUX_PRIORITY_NORMAL || priority > IOMUX_PRIORITY_HIGH) {
+        set_error(iomux, "%s: Invalid priority %d", __FUNCTION__, priority);
+        return 0;
+    }
+    return iomux_queue_output(iomux, fd, buf, len, mode, NULL, 0, 0, 0, priority);
+}
+
+int
+iomux_write_keyed(iomux_t *iomux, int fd, uint64_t key, unsigned char *buf, int len, int mode)
+{
+    return iomux_queue_output(iomux, fd, buf, len, mode, NULL, 0, 1, key, IOMUX_PRIORITY_NORMAL);
+}
+
+static void
+iomux_set_tcp_cork(iomux_connection_t *conn, int on)
+{
+    if (conn->flags & IOMUX_CONNECTION_NOTSOCK)
+        return;
+    // NOTE: this is just a best effort, it fails on non-TCP sockets
+#if defined(TCP_CORK)
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#elif defined(TCP_NOPUSH)
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on));
+#endif
+}
+
+static void
+iomux_uncork_connection(iomux_t *iomux, iomux_connection_t *conn)
+{
+    int fd = conn->fd;
+
+    conn->flags &= ~IOMUX_CONNECTION_CORKED;
+    timerclear(&conn->cork_expire);
+
+    if (!TAILQ_EMPTY(&conn->output_queue)) {
+        // flush everything queued while corked at once
+        // (while TCP_CORK is still set on the socket)
+        iomux_write_fd(iomux, fd, conn->cbs.priv);
+        if (iomux->connections[fd] != conn)
+            return;
+        if (!TAILQ_EMPTY(&conn->output_queue))
+            iomux_output_pending(iomux, conn);
+    }
+    iomux_set_tcp_cork(conn, 0);
+}
+
+int
+iomux_cork(iomux_t *iomux, int fd, struct timeval *timeout)
+{
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *conn = iomux->connections[fd];
+    if (!conn) {
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+
+    if (!(conn->flags & IOMUX_CONNECTION_CORKED)) {
+        conn->flags |= IOMUX_CONNECTION_CORKED;
+        iomux_set_tcp_cork(conn, 1);
+    }
+
+    if (timeout) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        timeradd(&now, timeout, &conn->cork_expire);
+    } else {
+        timerclear(&conn->cork_expire);
+    }
+
+    MUTEX_UNLOCK(iomux);
+    return 1;
+}
+
+int
+iomux_uncork(iomux_t *iomux, int fd)
+{
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *conn = iomux->connections[fd];
+    if (!conn || !(conn->flags & IOMUX_CONNECTION_CORKED)) {
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+    iomux_uncork_connection(iomux, conn);
+    MUTEX_UNLOCK(iomux);
+    return 1;
+}
+
+int
+iomux_close(iomux_t *iomux, int fd)
+{
+    MUTEX_LOCK(iomux);
+
+    iomux_connection_t *conn = iomux->connections[fd];
+    if (!conn) { // fd is not registered within iomux
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+
+    if (iomux_connection_busy(conn)) {
+        // closed by the thread dispatching it as soon as it's done
+        conn->flags |= IOMUX_CONNECTION_CLOSE_PENDING;
+        MUTEX_UNLOCK(iomux);
+        return 1;
+    }
 
     iomux_output_chunk_t *chunk = TAILQ_FIRST(&conn->output_queue);
     if (fcntl(fd, F_GETFD, 0) != -1 && chunk) { // there is pending data
         int retries = 0;
         iomux_output_chunk_t *last_chunk = NULL; // XXX - here to silence the static analyzer
         while (chunk && chunk != last_chunk && retries <= IOMUX_FLUSH_MAXRETRIES) {
-            int wb = write(fd, chunk->data, chunk->len);
+            int wb = chunk->addr
+                   ? sendto(fd, chunk->data, chunk->len, 0, chunk->addr, chunk->addrlen)
+                   : write(fd, chunk->data + chunk->offset, chunk->len - chunk->offset);
             if (wb == -1) {
                 if (errno == EINTR || errno == EAGAIN) {
                     retries++;
@@ -940,16 +2568,12 @@ iomux_close(iomux_t *iomux, int fd)
             } else if (wb == 0) {
                 fprintf(stderr, "%s: closing filedescriptor %d with pending data\n", __FUNCTION__, fd);
                 break;
+            } else if (!chunk->addr && wb < chunk->len - chunk->offset) {
+                iomux_output_advance(iomux, conn, chunk, wb);
+                continue;
             }
-            TAILQ_REMOVE(&conn->output_queue, chunk, next);
             retries = 0;
-            if (chunk->free) {
-                if (iomux->connections[fd]->cbs.mux_free_data)
-                    iomux->connections[fd]->cbs.mux_free_data(iomux, fd, chunk->data, chunk->len, iomux->connections[fd]->cbs.priv);
-                else
-                    free(chunk->data);
-            }
-            free(chunk);
+            iomux_output_dequeue(iomux, conn, chunk);
             // the static analyzer reports a false positive because not able
             // to properly understand the TAILQ_REMOVE macro.
             // The extra check against the last_chunk pointer is here just
@@ -993,6 +2617,9 @@ iomux_isempty(iomux_t *iomux)
 void
 iomux_destroy(iomux_t *iomux)
 {
+    MUTEX_LOCK(iomux);
+    iomux_handover_flush(iomux);
+    MUTEX_UNLOCK(iomux);
     iomux_clear(iomux);
 #if defined(HAVE_EPOLL)
     close(iomux->efd);
@@ -1003,12 +2630,49 @@ iomux_destroy(iomux_t *iomux)
         pthread_mutex_destroy(iomux->lock);
         free(iomux->lock);
     }
+    if (iomux->timers_lock) {
+        pthread_mutex_destroy(iomux->timers_lock);
+        free(iomux->timers_lock);
+    }
+    if (iomux->timers_cond) {
+        pthread_cond_destroy(iomux->timers_cond);
+        free(iomux->timers_cond);
+    }
     bh_destroy(iomux->timeouts);
     free(iomux->connections);
+    free(iomux->generations);
+    free(iomux->free_slots);
 #if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
     free(iomux->events);
 #endif
     close(iomux->emfile_fd);
+    if (iomux->wakeup_fd[1] != iomux->wakeup_fd[0])
+        close(iomux->wakeup_fd[1]);
+    if (iomux->wakeup_fd[0] >= 0)
+        close(iomux->wakeup_fd[0]);
+    // tasks posted while closing the connections are just released
+    iomux_task_t *task = iomux->posted;
+    while (task) {
+        iomux_task_t *next = task->next;
+        free(task);
+        task = next;
+    }
+    iomux_output_chunk_t *async = iomux->async_writes;
+    while (async) {
+        iomux_output_chunk_t *next = TAILQ_NEXT(async, next);
+        iomux_async_drop(iomux, (int)(async->key & 0xffffffff), async);
+        async = next;
+    }
+    while (iomux->inbuf_pool_count)
+        free(iomux->inbuf_pool[--iomux->inbuf_pool_count]);
+    free(iomux->inbuf_pool);
+    free(iomux->overflow);
+    free(iomux->dgram);
+    iomux_output_chunk_t *chunk;
+    while ((chunk = TAILQ_FIRST(&iomux->free_chunks))) {
+        TAILQ_REMOVE(&iomux->free_chunks, chunk, next);
+        free(chunk);
+    }
     free(iomux);
 }
 
@@ -1027,12 +2691,363 @@ iomux_clear(iomux_t *iomux)
     MUTEX_UNLOCK(iomux);
 }
 
-iomux_callbacks_t *
-iomux_callbacks(iomux_t *iomux, int fd)
+iomux_callbacks_t *
+iomux_callbacks(iomux_t *iomux, int fd)
+{
+    if (iomux->connections[fd])
+        return &iomux->connections[fd]->cbs;
+    return NULL;
+}
+
+int
+iomux_set_input_pool(iomux_t *iomux, int size)
+{
+    MUTEX_LOCK(iomux);
+    if (size < 0)
+        size = 0;
+
+    while (iomux->inbuf_pool_count > size)
+        free(iomux->inbuf_pool[--iomux->inbuf_pool_count]);
+
+    if (size) {
+        unsigned char **pool = realloc(iomux->inbuf_pool, sizeof(unsigned char *) * size);
+        if (!pool) {
+            set_error(iomux, "Can't allocate memory for the input pool: %s", strerror(errno));
+            MUTEX_UNLOCK(iomux);
+            return 0;
+        }
+        iomux->inbuf_pool = pool;
+    } else {
+        free(iomux->inbuf_pool);
+        iomux->inbuf_pool = NULL;
+    }
+    iomux->inbuf_pool_size = size;
+
+    MUTEX_UNLOCK(iomux);
+    return 1;
+}
+
+int
+iomux_pending_output(iomux_t *iomux, int fd)
+{
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *conn = iomux->connections[fd];
+    int pending = conn ? conn->output_len : -1;
+    MUTEX_UNLOCK(iomux);
+    return pending;
+}
+
+int
+iomux_set_output_watermarks(iomux_t *iomux, int fd, int low, int high)
+{
+    if (high < 0 || low < 0 || (high && low > high)) {
+        set_error(iomux, "%s: Invalid watermarks %d/%d", __FUNCTION__, low, high);
+        return 0;
+    }
+
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *conn = iomux->connections[fd];
+    if (!conn) {
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+    conn->output_low = low;
+    conn->output_high = high;
+    if (!high)
+        conn->flags &= ~IOMUX_CONNECTION_OUTPUT_FULL;
+    MUTEX_UNLOCK(iomux);
+    return 1;
+}
+
+void
+iomux_set_accept_budget(iomux_t *iomux, int budget)
+{
+    MUTEX_LOCK(iomux);
+    iomux->accept_budget = budget > 0 ? budget : 0;
+    MUTEX_UNLOCK(iomux);
+}
+
+void
+iomux_accept_stats(iomux_t *iomux, uint64_t *accepted, uint64_t *empty_wakeups)
+{
+    MUTEX_LOCK(iomux);
+    if (accepted)
+        *accepted = iomux->accepted;
+    if (empty_wakeups)
+        *empty_wakeups = iomux->accept_empty;
+    MUTEX_UNLOCK(iomux);
+}
+
+int
+iomux_set_accept_callbacks(iomux_t *iomux, int fd, iomux_callbacks_t *cbs)
+{
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *conn = iomux->connections[fd];
+    if (!conn) {
+        set_error(iomux, "%s: No connections for fd %d", __FUNCTION__, fd);
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+
+    iomux_callbacks_t *accept_cbs = NULL;
+    if (cbs) {
+        accept_cbs = malloc(sizeof(iomux_callbacks_t));
+        if (!accept_cbs) {
+            set_error(iomux, "%s: Can't allocate memory for the callbacks: %s", __FUNCTION__, strerror(errno));
+            MUTEX_UNLOCK(iomux);
+            return 0;
+        }
+        memcpy(accept_cbs, cbs, sizeof(iomux_callbacks_t));
+    }
+    free(conn->accept_cbs);
+    conn->accept_cbs = accept_cbs;
+    MUTEX_UNLOCK(iomux);
+    return 1;
+}
+
+void
+iomux_set_output_on_demand(iomux_t *iomux, int on)
+{
+    MUTEX_LOCK(iomux);
+    iomux->output_on_demand = on;
+    MUTEX_UNLOCK(iomux);
+}
+
+int
+iomux_want_output(iomux_t *iomux, int fd)
+{
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *conn = iomux->connections[fd];
+    if (!conn || !conn->cbs.mux_output) {
+        set_error(iomux, "%s: fd %d is not managed or has no mux_output callback", __FUNCTION__, fd);
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+    conn->flags |= IOMUX_CONNECTION_OUTPUT_WANTED;
+    if (!(conn->flags & IOMUX_CONNECTION_CORKED) && !conn->pacing_wakeup.tv_sec)
+        iomux_output_pending(iomux, conn);
+    MUTEX_UNLOCK(iomux);
+    return 1;
+}
+
+int
+iomux_set_output_hint(iomux_t *iomux, int fd, int hint)
+{
+    if (hint < 0 && hint != IOMUX_OUTPUT_HINT_KERNEL) {
+        set_error(iomux, "%s: Invalid output hint %d", __FUNCTION__, hint);
+        return 0;
+    }
+
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *conn = iomux->connections[fd];
+    if (!conn) {
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+    conn->output_hint = hint;
+    MUTEX_UNLOCK(iomux);
+    return 1;
+}
+
+int
+iomux_set_notsent_lowat(iomux_t *iomux, int fd, int lowat)
+{
+#if defined(TCP_NOTSENT_LOWAT)
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) != 0) {
+        set_error(iomux, "%s: Can't set TCP_NOTSENT_LOWAT on fd %d: %s", __FUNCTION__, fd, strerror(errno));
+        return 0;
+    }
+    return 1;
+#else
+    set_error(iomux, "%s: TCP_NOTSENT_LOWAT is not supported", __FUNCTION__);
+    return 0;
+#endif
+}
+
+int
+iomux_incoming_cpu(iomux_t *iomux, int fd)
+{
+#if defined(SO_INCOMING_CPU)
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0) {
+        set_error(iomux, "%s: Can't get SO_INCOMING_CPU on fd %d: %s", __FUNCTION__, fd, strerror(errno));
+        return -1;
+    }
+    return cpu;
+#else
+    set_error(iomux, "%s: SO_INCOMING_CPU is not supported", __FUNCTION__);
+    return -1;
+#endif
+}
+
+int
+iomux_set_pacing_rate(iomux_t *iomux, int fd, uint64_t rate, uint64_t burst)
+{
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *conn = iomux->connections[fd];
+    if (!conn) {
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+
+    if (!burst)
+        burst = rate / 100; // 10ms worth of data
+    if (burst < IOMUX_PACING_BURST_MIN)
+        burst = IOMUX_PACING_BURST_MIN;
+    conn->pacing_rate = rate;
+    conn->pacing_burst = burst > INT64_MAX ? INT64_MAX : burst;
+    conn->pacing_tokens = conn->pacing_burst;
+    gettimeofday(&conn->pacing_last, NULL);
+
+    if (!rate && conn->pacing_wakeup.tv_sec) {
+        memset(&conn->pacing_wakeup, 0, sizeof(conn->pacing_wakeup));
+        if (!TAILQ_EMPTY(&conn->output_queue) && !(conn->flags & IOMUX_CONNECTION_CORKED))
+            iomux_output_pending(iomux, conn);
+    }
+
+#if defined(SO_MAX_PACING_RATE)
+    // let the kernel pace the packets as well where supported
+    // (errors are ignored, it's not a socket or pacing is not available)
+    unsigned int max_rate = (!rate || rate > UINT_MAX) ? UINT_MAX : rate;
+    setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &max_rate, sizeof(max_rate));
+#endif
+
+    MUTEX_UNLOCK(iomux);
+    return 1;
+}
+
+int
+iomux_pause_input(iomux_t *iomux, int fd)
+{
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *conn = iomux->connections[fd];
+    if (!conn) {
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+    conn->flags |= IOMUX_CONNECTION_INPUT_PAUSED;
+    iomux_input_interest(iomux, conn);
+    MUTEX_UNLOCK(iomux);
+    return 1;
+}
+
+int
+iomux_resume_input(iomux_t *iomux, int fd)
+{
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *conn = iomux->connections[fd];
+    if (!conn) {
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+    conn->flags &= ~IOMUX_CONNECTION_INPUT_PAUSED;
+    iomux_input_interest(iomux, conn);
+    MUTEX_UNLOCK(iomux);
+    return 1;
+}
+
+void
+iomux_set_output_budget(iomux_t *iomux, size_t budget, iomux_budget_policy_t policy)
+{
+    MUTEX_LOCK(iomux);
+    __atomic_store_n(&iomux->output_budget, budget, __ATOMIC_RELAXED);
+    iomux->budget_policy = policy;
+    MUTEX_UNLOCK(iomux);
+}
+
+void
+iomux_output_budget_cb(iomux_t *iomux, iomux_cb_t cb, void *priv)
+{
+    MUTEX_LOCK(iomux);
+    iomux->budget_cb = cb;
+    iomux->budget_priv = priv;
+    MUTEX_UNLOCK(iomux);
+}
+
+void
+iomux_memory_usage(iomux_t *iomux, size_t *output, size_t *input)
+{
+    MUTEX_LOCK(iomux);
+    if (output)
+        *output = iomux->output_total;
+    if (input) {
+        size_t total = (size_t)iomux->inbuf_pool_count * iomux->bufsize;
+        if (iomux->overflow)
+            total += iomux->bufsize + iomux->overflow_size;
+        if (iomux->dgram)
+            total += sizeof(iomux_datagram_batch_t) + IOMUX_DATAGRAM_BATCH * iomux->bufsize;
+        iomux_connection_t *conn;
+        TAILQ_FOREACH(conn, &iomux->connections_list, next) {
+            if (conn->inbuf)
+                total += conn->bufsize;
+        }
+        *input = total;
+    }
+    MUTEX_UNLOCK(iomux);
+}
+
+unsigned char *
+iomux_input_take(iomux_t *iomux, int fd, int *size)
+{
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *conn = iomux->connections[fd];
+    if (!conn || iomux_input_state.iomux != iomux || !iomux_input_state.data || iomux_input_state.fd != fd) {
+        set_error(iomux, "%s: No input is being delivered for fd %d", __FUNCTION__, fd);
+        MUTEX_UNLOCK(iomux);
+        return NULL;
+    }
+
+    unsigned char *buf = iomux_input_state.data;
+    int bufsize = 0;
+    if (buf == conn->inbuf) {
+        // a fresh buffer will be attached at the next read
+        bufsize = conn->bufsize;
+        conn->inbuf = NULL;
+        conn->inlen = 0;
+    } else if (iomux_input_state.len <= iomux->bufsize && (buf = iomux_inbuf_get(iomux))) {
+        // the data lives in the overflow buffer but fits in a regular one,
+        // copy it there so that the overflow buffer can be kept
+        memcpy(buf, iomux_input_state.data, iomux_input_state.len);
+        bufsize = iomux->bufsize;
+    } else {
+        // hand the whole overflow buffer over,
+        // a new one will be allocated at the next read
+        buf = iomux_input_state.data;
+        bufsize = iomux->bufsize + iomux->overflow_size;
+        iomux->overflow = NULL;
+    }
+    iomux_input_state.data = NULL;
+    iomux_input_state.taken = 1;
+
+    if (size)
+        *size = bufsize;
+
+    MUTEX_UNLOCK(iomux);
+    return buf;
+}
+
+void
+iomux_input_release(iomux_t *iomux, unsigned char *buf, int size)
+{
+    MUTEX_LOCK(iomux);
+    if (!iomux->overflow && iomux->overflow_size && size == iomux->bufsize + iomux->overflow_size)
+        iomux->overflow = buf;
+    else
+        iomux_inbuf_put(iomux, buf, size);
+    MUTEX_UNLOCK(iomux);
+}
+
+int
+iomux_set_read_overflow(iomux_t *iomux, int size)
 {
-    if (iomux->connections[fd])
-        return &iomux->connections[fd]->cbs;
-    return NULL;
+    MUTEX_LOCK(iomux);
+    // NOTE: the buffer will be allocated again (if needed) at the next read
+    free(iomux->overflow);
+    iomux->overflow = NULL;
+    iomux->overflow_size = (size > 0) ? size : 0;
+    MUTEX_UNLOCK(iomux);
+    return 1;
 }
 
 int iomux_num_fds(iomux_t *iomux)
@@ -1077,17 +3092,9 @@ iomux_poll_connection(iomux_t *iomux, iomux_connection_t *connection, struct tim
     int fd = connection->fd;
     int len = connection->inlen;
 
-    if (len && connection->cbs.mux_input) {
-        int mb = connection->cbs.mux_input(iomux, fd, connection->inbuf, len, connection->cbs.priv);
-        if (iomux->connections[fd] == connection && iomux->connections[fd]->inlen == connection->inlen)
-        {
-            if (mb == connection->inlen) {
-                connection->inlen = 0;
-            } else if (mb) {
-                memmove(connection->inbuf, connection->inbuf + mb, len - mb);
-                connection->inlen -= mb;
-            }
-        }
+    if (len && connection->cbs.mux_input && !(connection->flags & IOMUX_CONNECTION_INPUT_PAUSED)) {
+        if (!iomux_input_deliver(iomux, connection, connection->inbuf, len, connection->cbs.mux_input, connection->cbs.priv))
+            return -1;
     }
 
     if (connection->expire_time.tv_sec) {
@@ -1102,51 +3109,65 @@ iomux_poll_connection(iomux_t *iomux, iomux_connection_t *connection, struct tim
         } else {
             struct timeval expire_time;
             timersub(&connection->expire_time, now, &expire_time);
-            if (!expire_min->tv_sec || timercmp(expire_min,  &expire_time, >))
+            if (!timerisset(expire_min) || timercmp(expire_min, &expire_time, >))
                 memcpy(expire_min, &expire_time, sizeof(struct timeval));
         }
     }
 
-    iomux_output_chunk_t *chunk = TAILQ_FIRST(&connection->output_queue);
-    if (!chunk && connection->cbs.mux_output) {
-        int len = 0;
-        unsigned char *data = NULL;
-        int mode = connection->cbs.mux_output(iomux, fd, &data, &len, connection->cbs.priv);
-
-        // NOTE: the output callback might have removed the fd from the mux
-        if (!iomux->connections[fd]) {
-            free(data);
-            return -1;
+    if (connection->cork_expire.tv_sec) {
+        if (timercmp(now, &connection->cork_expire, >=)) {
+            // the cork timeout expired, flush whatever has been queued so far
+            iomux_uncork_connection(iomux, connection);
+            if (iomux->connections[fd] != connection)
+                return -1;
+        } else {
+            struct timeval expire_time;
+            timersub(&connection->cork_expire, now, &expire_time);
+            if (!timerisset(expire_min) || timercmp(expire_min, &expire_time, >))
+                memcpy(expire_min, &expire_time, sizeof(struct timeval));
         }
+    }
 
-        if (data) {
-            chunk = calloc(1, sizeof(iomux_output_chunk_t));
-            if (!chunk) {
-                set_error(iomux, "%s: Can't allocate memory for the new chunk", __FUNCTION__, strerror(errno));
-                free(chunk);
-                return 0;
-            }
-            if (mode == IOMUX_OUTPUT_MODE_COPY) {
-                chunk->data = malloc(len);
-                if (!chunk->data) {
-                    set_error(iomux, "%s: Can't allocate memory for the chunk data", __FUNCTION__, strerror(errno));
-                    free(chunk);
-                    return 0;
-                }
-                memcpy(chunk->data, data, len);
-            } else {
-                chunk->data = data;
-            }
-            chunk->free = (mode != IOMUX_OUTPUT_MODE_NONE);
-            chunk->len = len;
-            TAILQ_INSERT_TAIL(&connection->output_queue, chunk, next);
+    if (connection->pacing_wakeup.tv_sec) {
+        if (timercmp(now, &connection->pacing_wakeup, >=)) {
+            // the token bucket refilled, we can go ahead sending
+            memset(&connection->pacing_wakeup, 0, sizeof(connection->pacing_wakeup));
+            if (!TAILQ_EMPTY(&connection->output_queue) && !(connection->flags & IOMUX_CONNECTION_CORKED))
+                iomux_output_pending(iomux, connection);
+        } else {
+            struct timeval expire_time;
+            timersub(&connection->pacing_wakeup, now, &expire_time);
+            if (!timerisset(expire_min) || timercmp(expire_min, &expire_time, >))
+                memcpy(expire_min, &expire_time, sizeof(struct timeval));
+        }
+    }
+
+    iomux_output_chunk_t *chunk = TAILQ_FIRST(&connection->output_queue);
+    if (!chunk && connection->cbs.mux_output && !iomux->output_on_demand) {
+        int rc = iomux_output_fetch(iomux, connection);
+        if (rc == -1)
+            return -1;
+        chunk = TAILQ_FIRST(&connection->output_queue);
 #if defined(HAVE_EPOLL)
-            // NOTE: In the epoll implementation we want to register a filedescriptor
-            //       for input events only if no data was in the queue but a new chunk
-            //       was provided via a mux_output callback
+        // NOTE: In the epoll implementation we want to register a filedescriptor
+        //       for input events only if no data was in the queue but a new chunk
+        //       was provided via a mux_output callback
+        if (rc == 1 && !(connection->flags & IOMUX_CONNECTION_CORKED))
             return 1;
 #endif
-        }
+    }
+
+    // NOTE: corked connections don't need to be notified for output events
+    if (connection->flags & IOMUX_CONNECTION_CORKED)
+        return 0;
+
+    // NOTE: connections which want to produce output are polled for
+    //       output events, mux_output will be called once writable
+    //       (unless writes over budget are being rejected)
+    if (!chunk && (connection->flags & IOMUX_CONNECTION_OUTPUT_WANTED) &&
+        !(iomux->budget_policy == IOMUX_BUDGET_POLICY_REJECT && iomux_output_budget_exceeded(iomux, 0)))
+    {
+        return 1;
     }
 
 #if !defined(HAVE_EPOLL)
@@ -1157,7 +3178,9 @@ iomux_poll_connection(iomux_t *iomux, iomux_connection_t *connection, struct tim
     //       registered for output events only once so if there was
     //       already a chunk in the queue, the filedescriptor was
     //       presumably already registered for output events.
-    if (chunk)
+    //       Paced connections are registered again once the
+    //       token bucket refilled.
+    if (chunk && !connection->pacing_wakeup.tv_sec)
         return 1;
 #endif
 
@@ -1177,23 +3200,36 @@ iomux_run(iomux_t *iomux, struct timeval *tv_default)
 
     MUTEX_LOCK(iomux);
 
+    if (iomux->budget_close)
+        iomux_output_budget_close(iomux);
+
     int n = 0;
     iomux_connection_t *connection = NULL;
     iomux_connection_t *tmp;
     TAILQ_FOREACH_SAFE(connection, &iomux->connections_list, next, tmp) {
         int prc = iomux_poll_connection(iomux, connection, &expire_min, &now);
 
+        // NOTE: the read filter is oneshot, leaving it out
+        //       is enough to stop polling for input
+        int blocked = (connection->flags & IOMUX_CONNECTION_INPUT_BLOCKED);
         switch(prc) {
             case -1:
                 continue;
             case 1:
-                memcpy(&iomux->events[n], &connection->event, 2 * sizeof(struct kevent));
-                n += 2;
+                if (blocked) {
+                    memcpy(&iomux->events[n], &connection->event[1], sizeof(struct kevent));
+                    n++;
+                } else {
+                    memcpy(&iomux->events[n], &connection->event, 2 * sizeof(struct kevent));
+                    n += 2;
+                }
                 break;
             case 0:
             default:
-                memcpy(&iomux->events[n], &connection->event, sizeof(struct kevent));
-                n++;
+                if (!blocked) {
+                    memcpy(&iomux->events[n], &connection->event, sizeof(struct kevent));
+                    n++;
+                }
                 break;
         }
     }
@@ -1214,15 +3250,10 @@ iomux_run(iomux_t *iomux, struct timeval *tv_default)
 
     MUTEX_UNLOCK(iomux);
     int cnt = 0;
-    if (n > 0) {
+    // NOTE: the wakeup descriptor is always registered so we can wait
+    //       on the kqueue even if there are no filedescriptors in the mux
+    if (n > 0 || tv)
         cnt = kevent(iomux->kfd, iomux->events, n, iomux->events, iomux->maxconnections * 2, tv ? &ts : NULL);
-    } else if (tv) {
-        struct timeval tv_select = { 0, 0 };
-        if (tv)
-            memcpy(&tv_select, tv, sizeof(tv_select));
-        // there are no filedescriptor in the mux, we just want to wait until next timeout expires
-        select(0, NULL, NULL, NULL, tv ? &tv_select : NULL);
-    }
     MUTEX_LOCK(iomux);
 
     if (cnt == -1) {
@@ -1231,6 +3262,10 @@ iomux_run(iomux_t *iomux, struct timeval *tv_default)
         for (i = 0; i < cnt; i++) {
             struct kevent *event = &iomux->events[i];
             int fd = event->ident;
+            if (fd == iomux->wakeup_fd[0]) {
+                iomux_wakeup_clear(iomux);
+                continue;
+            }
             iomux_connection_t *conn = iomux->connections[fd];
             if (!conn) {
                 // TODO - Error Messages
@@ -1240,11 +3275,8 @@ iomux_run(iomux_t *iomux, struct timeval *tv_default)
             if (event->filter == EVFILT_READ) {
                 if ((iomux->connections[fd]->flags&IOMUX_CONNECTION_SERVER) == (IOMUX_CONNECTION_SERVER) && event->data)
                 {
-                    while(event->data--) {
-                        iomux_connection_callback_t mux_connection = iomux->connections[fd]->cbs.mux_connection;
-                        void * priv = iomux->connections[fd]->cbs.priv;
-                        iomux_accept_connections_fd(iomux, fd, mux_connection, priv);
-                    }
+                    iomux_accept_connections_fd(iomux, fd);
+                    continue;
                 } else {
                     iomux_input_callback_t mux_input = iomux->connections[fd]->cbs.mux_input;
                     void * priv = iomux->connections[fd]->cbs.priv;
@@ -1263,12 +3295,118 @@ iomux_run(iomux_t *iomux, struct timeval *tv_default)
             }
         }
     }
+    iomux_run_async_writes(iomux);
+    iomux_run_posted(iomux);
     MUTEX_UNLOCK(iomux);
     iomux_run_timeouts(iomux);
 }
 
 #elif defined(HAVE_EPOLL)
 
+// NOTE - handles the events reported for fd, the lock is not held across
+//        the handlers so that, on oneshot muxes, mux_input can run without it
+static void
+iomux_epoll_dispatch(iomux_t *iomux, int fd, uint32_t events)
+{
+    if ((events & EPOLLHUP || events & EPOLLRDHUP))
+    {
+        iomux_close(iomux, fd);
+        return;
+    } else if ((events & EPOLLERR)) {
+        int error = 0;
+        socklen_t errlen = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errlen) == 0)
+        {
+            if (error == EINPROGRESS) // this is not an error
+                return;
+
+            fprintf (stderr, "epoll error on fd %d: %s\n", fd, strerror(error));
+            iomux_close(iomux, fd);
+        } else {
+            fprintf (stderr, "unkown epoll error on fd %d\n", fd);
+            iomux_close(iomux, fd);
+        }
+        return;
+    }
+
+    MUTEX_LOCK(iomux);
+    iomux_connection_t *conn = iomux->connections[fd];
+    if (!conn) {
+        if (fd == iomux->wakeup_fd[0])
+            iomux_wakeup_clear(iomux);
+        MUTEX_UNLOCK(iomux);
+        return;
+    }
+    iomux_input_callback_t mux_input = conn->cbs.mux_input;
+    void *priv = conn->cbs.priv;
+    int server = ((conn->flags&IOMUX_CONNECTION_SERVER) == (IOMUX_CONNECTION_SERVER));
+    MUTEX_UNLOCK(iomux);
+
+    if (server) {
+        iomux_accept_connections_fd(iomux, fd);
+        return;
+    }
+
+    if (events & EPOLLIN || events & EPOLLPRI)
+        iomux_read_fd(iomux, fd, mux_input, priv);
+
+    if (events & EPOLLOUT) {
+        MUTEX_LOCK(iomux);
+        if (iomux->connections[fd]) // connection might have been closed/removed
+            iomux_write_fd(iomux, fd, priv);
+        MUTEX_UNLOCK(iomux);
+    }
+}
+
+// NOTE - ends the dispatch of conn (oneshot muxes only), performs what
+//        the other threads asked for in the meanwhile and re-arms the fd
+static void
+iomux_oneshot_release(iomux_t *iomux, int fd, iomux_connection_t *conn, uint32_t generation)
+{
+    // the connection might have been closed/removed by its own callbacks
+    if (iomux->connections[fd] != conn || conn->generation != generation)
+        return;
+
+    conn->flags &= ~IOMUX_CONNECTION_BUSY;
+    if (conn->flags & IOMUX_CONNECTION_CLOSE_PENDING) {
+        iomux_close(iomux, fd);
+        return;
+    }
+    if (conn->flags & IOMUX_CONNECTION_REMOVE_PENDING) {
+        iomux_remove(iomux, fd);
+        return;
+    }
+
+    uint32_t oneshot = iomux_epoll_oneshot(iomux, conn);
+    if (!oneshot)
+        return;
+
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.data.fd = fd;
+    event.events = conn->events | oneshot;
+    if (epoll_ctl(iomux->efd, EPOLL_CTL_MOD, fd, &event) != 0) {
+        fprintf(stderr, "Errors re-arming fd %d on epoll instance %d : %s\n",
+                fd, iomux->efd, strerror(errno));
+    }
+}
+
+// NOTE - dispatches a busy connection on the calling thread,
+//        called (and returns) with the lock held exactly once
+static void
+iomux_oneshot_dispatch(iomux_t *iomux, iomux_connection_t *conn, uint32_t events)
+{
+    int fd = conn->fd;
+    uint32_t generation = conn->generation;
+    conn->owner = pthread_self();
+
+    MUTEX_UNLOCK(iomux);
+    iomux_epoll_dispatch(iomux, fd, events);
+    MUTEX_LOCK(iomux);
+
+    iomux_oneshot_release(iomux, fd, conn, generation);
+}
+
 void
 iomux_run(iomux_t *iomux, struct timeval *tv_default)
 {
@@ -1281,29 +3419,27 @@ iomux_run(iomux_t *iomux, struct timeval *tv_default)
 
     MUTEX_LOCK(iomux);
 
+    if (iomux->budget_close)
+        iomux_output_budget_close(iomux);
+
     iomux_connection_t *connection = NULL;
     iomux_connection_t *tmp;
     TAILQ_FOREACH_SAFE(connection, &iomux->connections_list, next, tmp) {
         int fd = connection->fd;
+        // connections being dispatched by other threads are left alone
+        if (connection->flags & IOMUX_CONNECTION_BUSY)
+            continue;
         int prc = iomux_poll_connection(iomux, connection, &expire_min, &now);
 
         switch(prc) {
             case -1:
                 continue;
             case 1:
-            {
-                struct epoll_event event;
-                bzero(&event, sizeof(event));
-                event.data.fd = fd;
-                event.events = EPOLLIN | EPOLLOUT;
-
-                int rc = epoll_ctl(iomux->efd, EPOLL_CTL_MOD, fd, &event);
-                if (rc == -1) {
+                if (!iomux_epoll_update(iomux, connection, 1)) {
                     fprintf(stderr, "Errors modifying fd %d to epoll instance %d : %s\n",
                             fd, iomux->efd, strerror(errno));
                 }
                 break;
-            }
             case 0:
             default:
                 break;
@@ -1312,6 +3448,13 @@ iomux_run(iomux_t *iomux, struct timeval *tv_default)
 
     int num_fds = iomux->num_fds;
 
+    // NOTE: several threads might be waiting on a oneshot mux,
+    //       each one needs its own array for the events
+    int oneshot = iomux->oneshot;
+    struct epoll_event oneshot_events[IOMUX_ONESHOT_BATCH];
+    struct epoll_event *events = oneshot ? oneshot_events : iomux->events;
+    int maxevents = oneshot ? IOMUX_ONESHOT_BATCH : num_fds + 1;
+
     MUTEX_UNLOCK(iomux);
 
     if (!tv_default ||
@@ -1323,70 +3466,52 @@ iomux_run(iomux_t *iomux, struct timeval *tv_default)
 
     // shrink the timeout if we have timers expiring earlier
     struct timeval *tv = iomux_adjust_timeout(iomux, tv_default);
-    int epoll_waiting_time = tv ? ((tv->tv_sec * 1000) + (tv->tv_usec / 1000)) : -1;
+    // NOTE: rounded up, a timer due in less than a millisecond
+    //       would otherwise turn the wait into a busy loop
+    int epoll_waiting_time = tv ? ((tv->tv_sec * 1000) + ((tv->tv_usec + 999) / 1000)) : -1;
 
+    // NOTE: the wakeup descriptor is always registered so we can wait
+    //       on the epoll instance even if there are no filedescriptors in the mux
     int n = 0;
-    if (num_fds > 0) {
-        n = epoll_wait(iomux->efd, iomux->events, num_fds, epoll_waiting_time);
-    } else if (tv) {
-        struct timeval tv_select = { 0, 0 };
-        if (tv)
-            memcpy(&tv_select, tv, sizeof(tv_select));
-        // there are no filedescriptor in the mux, we just want to wait until next timeout expires
-        select(0, NULL, NULL, NULL, tv ? &tv_select : NULL);
-    }
+    if (num_fds > 0 || tv)
+        n = epoll_wait(iomux->efd, events, maxevents, epoll_waiting_time);
 
     MUTEX_LOCK(iomux);
 
     int i;
     for (i = 0; i < n; i++) {
-        if ((iomux->events[i].events & EPOLLHUP || iomux->events[i].events & EPOLLRDHUP))
-        {
-            iomux_close(iomux, iomux->events[i].data.fd);
-            continue;
-        } else if ((iomux->events[i].events & EPOLLERR)) {
-            int error = 0;
-            socklen_t errlen = sizeof(error);
-            if (getsockopt(iomux->events[i].data.fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errlen) == 0)
-            {
-                if (error == EINPROGRESS) // this is not an error
-                    continue;
-
-                fprintf (stderr, "epoll error on fd %d: %s\n",
-                        iomux->events[i].data.fd, strerror(error));
-                iomux_close(iomux, iomux->events[i].data.fd);
-            } else {
-                fprintf (stderr, "unkown epoll error on fd %d\n", iomux->events[i].data.fd);
-                iomux_close(iomux, iomux->events[i].data.fd);
-            }
+        fd = events[i].data.fd;
+        if (!oneshot) {
+            iomux_epoll_dispatch(iomux, fd, events[i].events);
             continue;
         }
 
-        fd  = iomux->events[i].data.fd;
+        // NOTE: the fd is disarmed until the thread dispatching it is done,
+        //       an event for a busy fd can only come from a re-arm racing
+        //       with that thread which will report it again anyway
         iomux_connection_t *conn = iomux->connections[fd];
-        if (conn) {
-            iomux_connection_callback_t mux_connection = conn->cbs.mux_connection;
-            iomux_input_callback_t mux_input = conn->cbs.mux_input;
-            void *priv = conn->cbs.priv;
-
-            if ((conn->flags&IOMUX_CONNECTION_SERVER) == (IOMUX_CONNECTION_SERVER))
-            {
-                iomux_accept_connections_fd(iomux, fd, mux_connection, priv);
-            } else {
-                if (iomux->events[i].events & EPOLLIN || iomux->events[i].events & EPOLLPRI)
-                {
-                    iomux_read_fd(iomux, fd, mux_input, priv);
-                }
+        if (!conn) {
+            if (fd == iomux->wakeup_fd[0])
+                iomux_wakeup_clear(iomux);
+            continue;
+        }
+        if (conn->flags & IOMUX_CONNECTION_BUSY)
+            continue;
 
-                if (!iomux->connections[fd]) // connection has been closed/removed
-                    continue;
+        conn->flags |= IOMUX_CONNECTION_BUSY;
+        conn->owner = pthread_self();
 
-                if (iomux->events[i].events & EPOLLOUT) {
-                    iomux_write_fd(iomux, fd, priv);
-                }
-            }
+        // the executor keeps the connection busy until iomux_execute()
+        if (iomux->executor) {
+            iomux_conn_id_t id = ((iomux_conn_id_t)conn->generation << 32) | (uint32_t)fd;
+            if (iomux->executor(iomux, id, events[i].events, iomux->executor_priv))
+                continue;
         }
+
+        iomux_oneshot_dispatch(iomux, conn, events[i].events);
     }
+    iomux_run_async_writes(iomux);
+    iomux_run_posted(iomux);
     MUTEX_UNLOCK(iomux);
     iomux_run_timeouts(iomux);
 }
@@ -1411,6 +3536,9 @@ iomux_run(iomux_t *iomux, struct timeval *tv_default)
 
     MUTEX_LOCK(iomux);
 
+    if (iomux->budget_close)
+        iomux_output_budget_close(iomux);
+
     iomux_connection_t *connection = NULL;
     iomux_connection_t *tmp;
     TAILQ_FOREACH_SAFE(connection, &iomux->connections_list, next, tmp) {
@@ -1430,6 +3558,8 @@ iomux_run(iomux_t *iomux, struct timeval *tv_default)
                 // register the fd for input
             case 0:
             default:
+                if (connection->flags & IOMUX_CONNECTION_INPUT_BLOCKED)
+                    break;
                 FD_SET(fd, &rin[0]);
                 if (fd > maxfd)
                     maxfd = fd;
@@ -1446,6 +3576,10 @@ iomux_run(iomux_t *iomux, struct timeval *tv_default)
         tv_default = &expire_min;
     }
 
+    FD_SET(iomux->wakeup_fd[0], &rin[0]);
+    if (iomux->wakeup_fd[0] > maxfd)
+        maxfd = iomux->wakeup_fd[0];
+
     // NOTE: some select() implementations update the timeout with
     //       the unslept time (possibly 0 if no events happened)
     //       and we don't want to modify the timeout provided to us
@@ -1489,13 +3623,12 @@ iomux_run(iomux_t *iomux, struct timeval *tv_default)
         for (fd = iomux->minfd; fd <= iomux->maxfd; fd++) {
             iomux_connection_t *conn = iomux->connections[fd];
             if (conn) {
-                iomux_connection_callback_t mux_connection = conn->cbs.mux_connection;
                 iomux_input_callback_t mux_input = conn->cbs.mux_input;
                 void *priv = conn->cbs.priv;
                 if (FD_ISSET(fd, &rin[0])) {
                     // check if this is a listening socket
                     if ((iomux->connections[fd]->flags&IOMUX_CONNECTION_SERVER) == (IOMUX_CONNECTION_SERVER)) {
-                        iomux_accept_connections_fd(iomux, fd, mux_connection, priv);
+                        iomux_accept_connections_fd(iomux, fd);
                     } else {
                         iomux_read_fd(iomux, fd, mux_input, priv);
                     }
@@ -1508,14 +3641,261 @@ iomux_run(iomux_t *iomux, struct timeval *tv_default)
                 }
             }
         }
+        if (FD_ISSET(iomux->wakeup_fd[0], &rin[0]))
+            iomux_wakeup_clear(iomux);
     }
 
+    iomux_run_async_writes(iomux);
+    iomux_run_posted(iomux);
     MUTEX_UNLOCK(iomux);
     iomux_run_timeouts(iomux);
 }
 
 #endif
 
+// NOTE - releases a connection which couldn't be attached to any mux,
+//        mux_eof is called as it would have been by iomux_close()
+static void
+iomux_handover_drop(iomux_t *iomux, iomux_handover_t *handover)
+{
+    iomux_connection_t *conn = handover->conn;
+    int fd = conn->fd;
+    void (*mux_eof)(iomux_t *, int, void *) = conn->cbs.mux_eof;
+    void *priv = conn->cbs.priv;
+
+    iomux_connection_free(iomux, conn);
+    free(handover);
+    if (mux_eof)
+        mux_eof(iomux, fd, priv);
+}
+
+// NOTE - posted by iomux_move_fd(), attaches the connection to the mux running
+//        the task. If that's not possible the connection is handed back to the
+//        source mux the same way, and dropped if it can't be restored there either
+static void
+iomux_handover_attach(iomux_t *iomux, void *priv)
+{
+    iomux_handover_t *handover = (iomux_handover_t *)priv;
+    iomux_connection_t *conn = handover->conn;
+    int fd = conn->fd;
+
+    if (!iomux->connections[fd] && iomux_connection_attach(iomux, conn)) {
+        free(handover);
+        return;
+    }
+
+    iomux_t *src = handover->src;
+    if (src) {
+        fprintf(stderr, "Can't move fd %d, giving it back to the source mux\n", fd);
+        handover->src = NULL;
+        if (iomux_post(src, iomux_handover_attach, handover))
+            return;
+    }
+    fprintf(stderr, "Can't restore fd %d, dropping it\n", fd);
+    iomux_handover_drop(iomux, handover);
+}
+
+// NOTE - called by iomux_destroy(), attaches the connections still on their
+//        way to the mux so that they are closed together with all the others.
+//        The other tasks posted but never run are just released
+static void
+iomux_handover_flush(iomux_t *iomux)
+{
+    iomux_task_t *task;
+    // NOTE: a handover given back by the destination lands here again
+    while ((task = __atomic_exchange_n(&iomux->posted, NULL, __ATOMIC_ACQ_REL))) {
+        while (task) {
+            iomux_task_t *next = task->next;
+            if (task->cb == iomux_handover_attach)
+                task->cb(iomux, task->priv);
+            free(task);
+            task = next;
+        }
+    }
+}
+
+int
+iomux_post(iomux_t *iomux, iomux_cb_t cb, void *priv)
+{
+    if (!cb)
+        return 0;
+
+    iomux_task_t *task = malloc(sizeof(iomux_task_t));
+    if (!task) {
+        fprintf(stderr, "Can't allocate the task : %s\n", strerror(errno));
+        return 0;
+    }
+    task->cb = cb;
+    task->priv = priv;
+    task->next = __atomic_load_n(&iomux->posted, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&iomux->posted, &task->next, task, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    // NOTE: only the first task of a batch needs to wake up the loop,
+    //       the others will be drained together with it
+    if (!task->next)
+        iomux_wakeup(iomux);
+    return 1;
+}
+
+iomux_conn_id_t
+iomux_connection_id(iomux_t *iomux, int fd)
+{
+    MUTEX_LOCK(iomux);
+    iomux_conn_id_t id = 0;
+    if (fd >= 0 && fd < iomux->maxconnections && iomux->connections[fd])
+        id = ((iomux_conn_id_t)iomux->connections[fd]->generation << 32) | (uint32_t)fd;
+    MUTEX_UNLOCK(iomux);
+    return id;
+}
+
+int
+iomux_write_async(iomux_t *iomux, iomux_conn_id_t id, unsigned char *buf, int len, iomux_output_mode_t mode)
+{
+    return iomux_async_push(iomux, id, buf, len, mode, IOMUX_PRIORITY_NORMAL);
+}
+
+int
+iomux_set_oneshot(iomux_t *iomux, int on)
+{
+#if defined(HAVE_EPOLL)
+    if (!iomux->lock) {
+        set_error(iomux, "%s: Oneshot dispatch requires a threadsafe mux", __FUNCTION__);
+        return 0;
+    }
+
+    MUTEX_LOCK(iomux);
+    if (iomux->oneshot == !!on) {
+        MUTEX_UNLOCK(iomux);
+        return 1;
+    }
+    iomux->oneshot = !!on;
+
+    // the connections already registered need to be (dis)armed accordingly
+    iomux_connection_t *conn;
+    TAILQ_FOREACH(conn, &iomux->connections_list, next) {
+        if (conn->flags & IOMUX_CONNECTION_EXCLUSIVE)
+            continue;
+        struct epoll_event event;
+        bzero(&event, sizeof(event));
+        event.data.fd = conn->fd;
+        event.events = conn->events | iomux_epoll_oneshot(iomux, conn);
+        if (epoll_ctl(iomux->efd, EPOLL_CTL_MOD, conn->fd, &event) != 0) {
+            fprintf(stderr, "Errors modifying fd %d on epoll instance %d : %s\n",
+                    conn->fd, iomux->efd, strerror(errno));
+        }
+    }
+
+#if defined(EPOLLEXCLUSIVE)
+    // NOTE: a posted task (or a handed over write) needs to wake up only one
+    //       of the threads waiting on the mux, EPOLLEXCLUSIVE can't be changed
+    //       with EPOLL_CTL_MOD so the wakeup fd is removed and added back
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.data.fd = iomux->wakeup_fd[0];
+    event.events = EPOLLIN | (iomux->oneshot ? EPOLLEXCLUSIVE : 0);
+    epoll_ctl(iomux->efd, EPOLL_CTL_DEL, iomux->wakeup_fd[0], &event);
+    if (epoll_ctl(iomux->efd, EPOLL_CTL_ADD, iomux->wakeup_fd[0], &event) != 0) {
+        fprintf(stderr, "Errors adding the wakeup fd %d to epoll instance %d : %s\n",
+                iomux->wakeup_fd[0], iomux->efd, strerror(errno));
+    }
+#endif
+    MUTEX_UNLOCK(iomux);
+    return 1;
+#else
+    if (on)
+        set_error(iomux, "%s: Oneshot dispatch is supported only with epoll", __FUNCTION__);
+    return !on;
+#endif
+}
+
+int
+iomux_set_executor(iomux_t *iomux, iomux_executor_cb_t cb, void *priv)
+{
+    MUTEX_LOCK(iomux);
+    if (cb && !iomux->oneshot) {
+        set_error(iomux, "%s: An executor requires the oneshot dispatch", __FUNCTION__);
+        MUTEX_UNLOCK(iomux);
+        return 0;
+    }
+    iomux->executor = cb;
+    iomux->executor_priv = priv;
+    MUTEX_UNLOCK(iomux);
+    return 1;
+}
+
+void
+iomux_execute(iomux_t *iomux, iomux_conn_id_t id, uint32_t events)
+{
+#if defined(HAVE_EPOLL)
+    int fd = (int)(id & 0xffffffff);
+    uint32_t generation = (uint32_t)(id >> 32);
+
+    MUTEX_LOCK(iomux);
+    if (fd < 0 || fd >= iomux->maxconnections) {
+        MUTEX_UNLOCK(iomux);
+        return;
+    }
+    // NOTE: the connection might have been closed by the thread
+    //       running the mux after having been handed to the executor
+    iomux_connection_t *conn = iomux->connections[fd];
+    if (conn && conn->generation == generation && (conn->flags & IOMUX_CONNECTION_BUSY))
+        iomux_oneshot_dispatch(iomux, conn, events);
+    MUTEX_UNLOCK(iomux);
+#endif
+}
+
+int
+iomux_move_fd(iomux_t *src, iomux_t *dst, int fd)
+{
+    if (src == dst)
+        return 1;
+
+    if (fd >= dst->maxconnections) {
+        set_error(src, "%s: fd %d exceeds max fd %d", __FUNCTION__, fd, dst->maxconnections);
+        return 0;
+    }
+
+    iomux_handover_t *handover = malloc(sizeof(iomux_handover_t));
+    if (!handover) {
+        set_error(src, "%s: Can't allocate the handover: %s", __FUNCTION__, strerror(errno));
+        return 0;
+    }
+
+    MUTEX_LOCK(src);
+    if (fd < 0 || fd >= src->maxconnections || !src->connections[fd]) {
+        set_error(src, "%s: No connections for fd %d", __FUNCTION__, fd);
+        MUTEX_UNLOCK(src);
+        free(handover);
+        return 0;
+    }
+    if (src->connections[fd]->flags & IOMUX_CONNECTION_BUSY) {
+        set_error(src, "%s: fd %d is being dispatched", __FUNCTION__, fd);
+        MUTEX_UNLOCK(src);
+        free(handover);
+        return 0;
+    }
+    handover->src = src;
+    handover->conn = iomux_connection_detach(src, fd);
+
+    // NOTE: the connection is attached by the thread running dst, the caller
+    //       never takes the lock of dst so that moving connections in both
+    //       directions from callbacks running on different threads can't deadlock
+    if (!iomux_post(dst, iomux_handover_attach, handover)) {
+        set_error(src, "%s: Can't hand fd %d over to the destination mux", __FUNCTION__, fd);
+        if (!iomux_connection_attach(src, handover->conn)) {
+            fprintf(stderr, "Can't restore fd %d on the source mux, dropping it\n", fd);
+            iomux_connection_free(src, handover->conn);
+        }
+        MUTEX_UNLOCK(src);
+        free(handover);
+        return 0;
+    }
+    MUTEX_UNLOCK(src);
+    return 1;
+}
+
 static int
 iomux_binheap_iterator_move_callback(bh_t *bh, uint64_t key, void *value, size_t vlen, void *priv)
 {
@@ -1542,30 +3922,24 @@ iomux_move(iomux_t *src, iomux_t *dst)
 
         int fd = connection->fd;
 
-        iomux_callbacks_t cbs;
-        memcpy(&cbs, &connection->cbs, sizeof(cbs));
-
-        if (iomux_add(dst, fd, &cbs)) {
-            iomux_connection_t *new_connection = dst->connections[fd];
-            free(new_connection->inbuf);
-            new_connection->inbuf = connection->inbuf;
-            new_connection->bufsize = connection->bufsize;
-            new_connection->inlen = connection->inlen;
-            connection->inbuf = NULL;
-            connection->bufsize = 0;
-            iomux_output_chunk_t *chunk = NULL;
-            iomux_output_chunk_t *ctmp;
-            TAILQ_FOREACH_SAFE(chunk, &connection->output_queue, next, ctmp) {
-                TAILQ_REMOVE(&connection->output_queue, chunk, next);
-                TAILQ_INSERT_TAIL(&new_connection->output_queue, chunk, next);
-            }
-        }
+        // connections being dispatched stay where they are
+        if (connection->flags & IOMUX_CONNECTION_BUSY)
+            continue;
 
-        iomux_remove(src, connection->fd);
+        iomux_connection_detach(src, fd);
+        if (fd >= dst->maxconnections || dst->connections[fd] ||
+            !iomux_connection_attach(dst, connection))
+        {
+            iomux_connection_free(src, connection);
+        }
         count++;
     }
 
+    TIMERS_LOCK(src);
+    TIMERS_LOCK(dst);
     bh_foreach(src->timeouts, iomux_binheap_iterator_move_callback, (void *)dst);
+    TIMERS_UNLOCK(dst);
+    TIMERS_UNLOCK(src);
 
     MUTEX_UNLOCK(src);
     MUTEX_UNLOCK(dst);
@@ -13,6 +13,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <sys/socket.h>
 
 //! if set to true, the hangup callback (if any) will be called at the end of the current runcycle
 extern int iomux_hangup;
@@ -22,12 +23,32 @@ typedef void (*iomux_cb_t)(iomux_t *iomux, void *priv);
 
 typedef uint64_t iomux_timeout_id_t;
 
+//! identifies a connection, it's not reused when the fd is (see iomux_connection_id())
+typedef uint64_t iomux_conn_id_t;
+
+//! receives a ready connection to be dispatched later by iomux_execute() (see iomux_set_executor())
+typedef int (*iomux_executor_cb_t)(iomux_t *iomux, iomux_conn_id_t id, uint32_t events, void *priv);
+
 typedef enum {
     IOMUX_OUTPUT_MODE_COPY = -1,
     IOMUX_OUTPUT_MODE_FREE =  1,
     IOMUX_OUTPUT_MODE_NONE =  0
 } iomux_output_mode_t;
 
+typedef enum {
+    IOMUX_BUDGET_POLICY_REJECT = 0,
+    IOMUX_BUDGET_POLICY_DROP_OLDEST,
+    IOMUX_BUDGET_POLICY_CLOSE_LARGEST
+} iomux_budget_policy_t;
+
+//! estimate the writable space from the socket send buffer (see iomux_set_output_hint())
+#define IOMUX_OUTPUT_HINT_KERNEL (-1)
+
+typedef enum {
+    IOMUX_PRIORITY_NORMAL = 0,
+    IOMUX_PRIORITY_HIGH = 1
+} iomux_priority_t;
+
 /**
  * @brief Handle input coming from a managed filedescriptor
  * @param iomux The iomux handle
@@ -48,7 +69,9 @@ typedef int (*iomux_input_callback_t)(iomux_t *iomux, int fd, unsigned char *dat
  * @param iomux The iomux handle
  * @param fd The fd the timer relates to
  * @param data A reference to the pointer to where the data is stored
- * @param len  A pointer to where to store length of the data
+ * @param len  A pointer to where to store length of the data.
+ *             On input it holds an estimate of how many bytes fd can accept
+ *             right now (0 if no hint has been configured, see iomux_set_output_hint())
  * @param priv the private pointer registered with the callbacks
  * @return the iomux_output_mode which determines if the data has to be copied,
  *         freed or ignored (in which case the caller needs to take care of releasing the underlying memory)
@@ -90,6 +113,19 @@ typedef void (*iomux_eof_callback_t)(iomux_t *iomux, int fd, void *priv);
  */
 typedef void (*iomux_connection_callback_t)(iomux_t *iomux, int fd, void *priv);
 
+/*
+ * @brief Callback called on a listening fildescriptor when a new connection arrives
+ * @param iomux The iomux handle
+ * @param fd The new (non-blocking) fd
+ * @param addr The address of the peer
+ * @param addrlen The size of the peer address
+ * @param priv the private pointer registered with the callbacks
+ * @note Same as iomux_connection_callback_t but also provides the peer address.
+ *       If the listener has been given a callbacks template with
+ *       iomux_set_accept_callbacks() fd has been already added to the mux
+ */
+typedef void (*iomux_accept_callback_t)(iomux_t *iomux, int fd, struct sockaddr *addr, socklen_t addrlen, void *priv);
+
 /*
  * @brief Callback called when an output chunk can be safely relised (because flushed)
  * @param iomux The iomux handle
@@ -100,6 +136,44 @@ typedef void (*iomux_connection_callback_t)(iomux_t *iomux, int fd, void *priv);
  */
 typedef void (*iomux_free_data_callback_t)(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv);
 
+/*
+ * @brief Callback called when a managed filedescriptor in raw mode is ready for reading
+ * @param iomux The iomux handle
+ * @param fd The fd which is ready for reading
+ * @param priv the private pointer registered with the callbacks
+ * @note The mux doesn't read from filedescriptors for which this callback
+ *       has been registered (and doesn't allocate any input buffer for them),
+ *       the callback is responsible of reading the data itself.
+ *       If the callback detects the end-of-file it should call iomux_close()
+ */
+typedef void (*iomux_readable_callback_t)(iomux_t *iomux, int fd, void *priv);
+
+/*
+ * @brief Callback called for each datagram received on a managed filedescriptor in datagram mode
+ * @param iomux The iomux handle
+ * @param fd The fd the datagram has been received from
+ * @param data The datagram payload
+ * @param len The size of the payload
+ * @param addr The address of the sender
+ * @param addrlen The size of the sender address
+ * @param priv the private pointer registered with the callbacks
+ * @note Datagrams are received in batches (using recvmmsg() where available)
+ *       and each of them is passed to the callback separately.
+ *       Datagrams larger than the mux bufsize are truncated
+ */
+typedef void (*iomux_datagram_callback_t)(iomux_t *iomux, int fd, unsigned char *data, int len,
+                                          struct sockaddr *addr, socklen_t addrlen, void *priv);
+
+/*
+ * @brief Callback called when the output queued on a filedescriptor crosses one of its watermarks
+ * @param iomux The iomux handle
+ * @param fd The fd the output is queued for
+ * @param pending The number of bytes queued and not yet written
+ * @param priv the private pointer registered with the callbacks
+ * @note See iomux_set_output_watermarks()
+ */
+typedef void (*iomux_watermark_callback_t)(iomux_t *iomux, int fd, int pending, void *priv);
+
 /**
  * @struct iomux_callbacks_t
  * @brief iomux callbacks structure
@@ -119,6 +193,16 @@ typedef struct _iomux_callbacks {
     iomux_free_data_callback_t mux_free_data;
     //! A pointer to private data which will be passed to all the callbacks as last argument
     void *priv;
+    //! If not NULL, the mux won't read from fd (raw mode) but will call this callback when fd is readable
+    iomux_readable_callback_t mux_readable;
+    //! If not NULL, fd is a datagram socket and this callback will be called for each received datagram
+    iomux_datagram_callback_t mux_datagram;
+    //! If not NULL, it will be called when the output queued on fd reaches the high watermark
+    iomux_watermark_callback_t mux_output_full;
+    //! If not NULL, it will be called when the output queued on fd drops back to the low watermark
+    iomux_watermark_callback_t mux_output_drained;
+    //! If not NULL and fd is a listening socket, it will be called instead of mux_connection
+    iomux_accept_callback_t mux_accept;
 } iomux_callbacks_t;
 
 /**
@@ -127,6 +211,65 @@ typedef struct _iomux_callbacks {
  */
 iomux_t *iomux_create(int bufsize, int threadsafe);
 
+/**
+ * @brief Attach input buffers on demand, taking them from a per-mux pool
+ * @param iomux A valid iomux handler
+ * @param size The maximum number of idle buffers kept in the pool
+ *             (0 disables the pool, which is the default)
+ * @returns TRUE on success; FALSE otherwise
+ * @note When the pool is enabled a managed filedescriptor holds an input
+ *       buffer only while there is data not yet consumed by mux_input.
+ *       The buffer is taken from the pool when a read actually happens
+ *       and given back as soon as all the data has been consumed, so
+ *       idle connections don't use any input buffer memory.
+ */
+int iomux_set_input_pool(iomux_t *iomux, int size);
+
+/**
+ * @brief Set the size of the per-mux overflow buffer used when reading
+ * @param iomux A valid iomux handler
+ * @param size The size of the overflow buffer (0 disables it).
+ *             Defaults to 64KB
+ * @returns TRUE on success; FALSE otherwise
+ * @note Reads are performed with readv() into the free space of the
+ *       connection input buffer plus the overflow buffer, so that
+ *       everything available on the filedescriptor can be pulled with
+ *       a single syscall and passed to mux_input at once.
+ *       Only the bytes which haven't been consumed by mux_input are
+ *       then retained in the connection input buffer.
+ */
+int iomux_set_read_overflow(iomux_t *iomux, int size);
+
+/**
+ * @brief Take ownership of the buffer holding the input being passed to mux_input
+ * @param iomux A valid iomux handler
+ * @param fd The fd whose mux_input callback is currently running
+ * @param size If not NULL, the size of the returned buffer will be stored here
+ * @returns The buffer, which begins with the data passed to mux_input,
+ *          or NULL if no input is being delivered for fd
+ * @note This can only be called from within the mux_input callback.
+ *       All the data passed to the callback is considered consumed,
+ *       regardless of the value returned by the callback, and the mux
+ *       will attach a fresh buffer (from the input pool if enabled)
+ *       at the next read.
+ *       Input read into the overflow buffer (see iomux_set_read_overflow())
+ *       is copied into a regular buffer if it fits, otherwise the whole
+ *       overflow buffer is handed over (and the returned size is bigger).
+ * @note The buffer must be given back using iomux_input_release()
+ */
+unsigned char *iomux_input_take(iomux_t *iomux, int fd, int *size);
+
+/**
+ * @brief Give back a buffer obtained using iomux_input_take()
+ * @param iomux The iomux handler the buffer has been taken from
+ * @param buf The buffer returned by iomux_input_take()
+ * @param size The size of the buffer as returned by iomux_input_take()
+ * @note If the mux has been created as threadsafe this can be called
+ *       by any thread (for instance by a worker the buffer has been
+ *       handed off to)
+ */
+void iomux_input_release(iomux_t *iomux, unsigned char *buf, int size);
+
 /**
  * @brief Add a filedescriptor to the mux
  * @param iomux A valid iomux handler
@@ -180,6 +323,67 @@ iomux_timeout_id_t iomux_schedule(iomux_t *iomux,
                                   void *priv,
                                   iomux_timeout_free_context_cb free_ctx_cb);
 
+/**
+ * @brief Run a callback on the thread running the mux
+ * @param iomux The iomux handle
+ * @param cb The callback
+ * @param priv A private context which will be passed to the callback
+ * @returns TRUE on success; FALSE otherwise.
+ * @note Can be called from any thread without taking the mux lock.
+ *       The mux is woken up if waiting for events and all the posted
+ *       callbacks are run, in order, at the end of the current runcycle.
+ *       Callbacks still pending when the mux is destroyed are not run
+ *       (but connections being moved with iomux_move_fd() are still closed).
+ */
+int iomux_post(iomux_t *iomux, iomux_cb_t cb, void *priv);
+
+/**
+ * @brief Let several threads run the same mux concurrently
+ * @param iomux A threadsafe iomux handler
+ * @param on TRUE to enable the oneshot dispatch, FALSE to disable it
+ * @returns TRUE on success; FALSE otherwise (the mux is not threadsafe
+ *          or the backend is not epoll)
+ * @note The filedescriptors are registered with EPOLLONESHOT so that all the
+ *       threads calling iomux_run() can wait on the same epoll instance
+ *       while each connection is dispatched by only one of them at a time
+ *       (its callbacks never run concurrently) and re-armed once done.
+ *       mux_input is called without holding the mux lock so that a slow
+ *       callback doesn't stall the other connections, all the other
+ *       callbacks are still serialized.
+ *       A connection closed or removed by another thread while being
+ *       dispatched is closed/removed when its callback returns and it
+ *       can't be moved to another mux in the meanwhile.
+ *       Must be called while no thread is running the mux.
+ */
+int iomux_set_oneshot(iomux_t *iomux, int on);
+
+/**
+ * @brief Hand the ready connections to an executor instead of dispatching them
+ * @param iomux A oneshot iomux handler (see iomux_set_oneshot())
+ * @param cb The executor callback, NULL to dispatch the connections in iomux_run() again
+ * @param priv A private context which will be passed to the callback
+ * @returns TRUE on success; FALSE if the oneshot dispatch is not enabled
+ * @note The callback is called by iomux_run(), holding the mux lock, for each
+ *       connection with pending events. If it returns TRUE the connection stays
+ *       disarmed until the events are passed to iomux_execute(), by any thread,
+ *       so its callbacks still run one at a time and in order.
+ *       If it returns FALSE the connection is dispatched straight away
+ */
+int iomux_set_executor(iomux_t *iomux, iomux_executor_cb_t cb, void *priv);
+
+/**
+ * @brief Dispatch a connection handed to the executor
+ * @param iomux The iomux handler the connection belongs to
+ * @param id The id passed to the executor callback
+ * @param events The events passed to the executor callback
+ * @note Can be called from any thread, connections closed in the meanwhile are skipped.
+ *       Each connection handed to the executor must be executed once, until then
+ *       it's not polled for events anymore.
+ *       Must not be called from a callback of the same mux (holding its lock),
+ *       mux_input is meant to run without it
+ */
+void iomux_execute(iomux_t *iomux, iomux_conn_id_t id, uint32_t events);
+
 /**
  * @brief Reset the schedule time on a timed callback.
  * @param iomux The iomux handle
@@ -211,6 +415,9 @@ iomux_timeout_id_t iomux_reschedule(iomux_t *iomux,
  * @param iomux The iomux handle
  * @param id The timeout id
  * @returns TRUE on success; FALSE otherwise.
+ * @note If the timeout is firing on another thread the call waits for the
+ *       callback to return (and FALSE is returned), so that the context
+ *       can be safely released afterwards
  */
 int  iomux_unschedule(iomux_t *iomux,
                       iomux_timeout_id_t id);
@@ -221,6 +428,8 @@ int  iomux_unschedule(iomux_t *iomux,
  * @param cb The callback handle
  * @param priv The context
  * @note Removes _all_ instances that match.
+ *       If one of them is firing on another thread the call waits
+ *       for the callback to return (see iomux_unschedule())
  * @returns The number of removed callbacks.
  */
 int  iomux_unschedule_all(iomux_t *iomux, iomux_cb_t cb, void *priv);
@@ -233,6 +442,48 @@ int  iomux_unschedule_all(iomux_t *iomux, iomux_cb_t cb, void *priv);
  */
 int  iomux_listen(iomux_t *iomux, int fd);
 
+/**
+ * @brief Put a filedescriptor shared with other muxes (or processes) to listening state
+ * @param iomux A valid iomux handler
+ * @param fd The fd to put in listening state
+ * @returns TRUE on success; FALSE otherwise.
+ * @note With the epoll backend the listener is registered with EPOLLEXCLUSIVE,
+ *       so a new connection wakes up only one of the muxes waiting on it
+ *       instead of all of them. On other backends this is the same as iomux_listen()
+ */
+int  iomux_listen_exclusive(iomux_t *iomux, int fd);
+
+/**
+ * @brief Set the maximum number of connections accepted on a listener at each runcycle
+ * @param iomux A valid iomux handler
+ * @param budget The maximum number of connections (0 means unlimited)
+ * @note Pending connections exceeding the budget are accepted at the next runcycle,
+ *       so that a burst of new connections can't starve the established ones
+ */
+void iomux_set_accept_budget(iomux_t *iomux, int budget);
+
+/**
+ * @brief Get the accept counters of the mux
+ * @param iomux A valid iomux handler
+ * @param accepted If not NULL will be set to the number of connections accepted so far
+ * @param empty_wakeups If not NULL will be set to the number of times a listener
+ *                      has been notified but there was no connection to accept
+ *                      (someone else sharing the listener got it first)
+ */
+void iomux_accept_stats(iomux_t *iomux, uint64_t *accepted, uint64_t *empty_wakeups);
+
+/**
+ * @brief Register the connections accepted on a listener automatically
+ * @param iomux A valid iomux handler
+ * @param fd The listening fd
+ * @param cbs The callbacks the new connections will be added to the mux with
+ *            (NULL to stop adding them automatically)
+ * @returns TRUE on success; FALSE otherwise
+ * @note The mux_connection (or mux_accept) callback of the listener is still called
+ *       once the new connection has been added
+ */
+int iomux_set_accept_callbacks(iomux_t *iomux, int fd, iomux_callbacks_t *cbs);
+
 /**
  * @brief Register the callback which will be called by iomux_loop()
  *        at each runcycle before calling iomux_run()
@@ -277,6 +528,18 @@ void iomux_hangup_cb(iomux_t *iomux, iomux_cb_t cb, void *priv);
  */
 void iomux_loop(iomux_t *iomux, struct timeval *timeout);
 
+/**
+ * @brief Run a single runcycle of iomux_loop()
+ * @param iomux A valid iomux handler
+ * @param timeout The maximum amount of time that iomux_run() can spend waiting
+ * @returns TRUE if the loop can go on; FALSE if it has been ended
+ *          (see iomux_end_loop()), in which case the end_loop callback
+ *          has been called and the mux doesn't need to be run
+ * @note Calls the loop_next and hangup callbacks around iomux_run() as iomux_loop() does.
+ *       Useful to run the mux from a loop which needs to do more at each runcycle
+ */
+int iomux_loop_once(iomux_t *iomux, struct timeval *timeout);
+
 /**
  * @brief Stop a running mux and return control back to the
  *        iomux_loop() caller
@@ -307,9 +570,284 @@ void iomux_run(iomux_t *iomux, struct timeval *timeout);
  *             freed or ignored (in which case the caller needs to take care of releasing
  *             the underlying memory)
  * @returns The number of written bytes
+ * @note If the mux is threadsafe and another thread is holding it (for instance
+ *       while running callbacks) the data is not queued right away but handed
+ *       to the loop thread as with iomux_write_async(), without waiting for the lock.
+ *       The data is bound to the connection registered for fd at the time of the call
+ *       and it's dropped if that connection is closed before the loop thread queues it.
+ *       In that case len is returned even though the data is never queued and nothing
+ *       reports the drop (data is released as if it had been queued and sent).
+ *       Writers always wait for the lock if an output budget is set
+ *       (see iomux_set_output_budget())
+ * @note With IOMUX_OUTPUT_MODE_FREE the mux owns data once len is returned.
+ *       If 0 is returned the ownership depends on the reason:
+ *       - fd is not registered or the output budget rejected the data
+ *         or the mux ran out of memory: the caller still owns data
+ *       - the budget callback removed fd: data has been released by the mux
+ *       - fd couldn't be registered for output events: data has been queued
+ *         and it's released by the mux together with the connection
+ *       The same applies to all the other write functions.
+ *       The mux releases data through the mux_free_data callback of the connection
  */
 int iomux_write(iomux_t *iomux, int fd, unsigned char *data, int len, iomux_output_mode_t mode);
 
+/**
+ * @brief Write data to a managed filedescriptor with a specific priority
+ * @param iomux A valid iomux handler
+ * @param fd The fd to write to
+ * @param data The data to write
+ * @param len The length of the data
+ * @param mode The output mode (see iomux_write())
+ * @param priority The priority of the data
+ * @returns The number of written bytes
+ * @note Higher priority data is sent before any lower priority data queued
+ *       earlier, a chunk which has been partially written is always completed first.
+ *       iomux_write() queues data with IOMUX_PRIORITY_NORMAL
+ */
+int iomux_write_priority(iomux_t *iomux, int fd, unsigned char *data, int len, iomux_output_mode_t mode, iomux_priority_t priority);
+
+/**
+ * @brief Write data to a managed filedescriptor replacing any stale update for the same key
+ * @param iomux A valid iomux handler
+ * @param fd The fd to write to
+ * @param key The key identifying the data (for instance the instrument of a market data update)
+ * @param data The data to write
+ * @param len The length of the data
+ * @param mode The output mode (see iomux_write())
+ * @returns The number of written bytes
+ * @note If a chunk written with the same key is still queued and none of its bytes
+ *       has been sent yet, the new data takes its place in the queue and the old data
+ *       is released (through the mux_free_data callback if the mode requires it).
+ *       This bounds the queue of a slow consumer to one update per key.
+ */
+int iomux_write_keyed(iomux_t *iomux, int fd, uint64_t key, unsigned char *data, int len, iomux_output_mode_t mode);
+
+/**
+ * @brief Get the id of the connection currently registered for fd
+ * @param iomux A valid iomux handler
+ * @param fd The filedescriptor
+ * @returns The connection id; 0 if fd is not registered with the mux
+ * @note The id can be passed to other threads to write with iomux_write_async()
+ */
+iomux_conn_id_t iomux_connection_id(iomux_t *iomux, int fd);
+
+/**
+ * @brief Write data to a connection from a thread not running the mux
+ * @param iomux A valid iomux handler
+ * @param id The connection id (see iomux_connection_id())
+ * @param data The data to write
+ * @param len The length of the data
+ * @param mode The output mode (see iomux_write())
+ * @returns len if the data has been handed to the mux; 0 otherwise, also if the
+ *          connection is already gone (the caller still owns the data, whatever the mode)
+ * @note Doesn't take the mux lock. The data is passed to the loop thread through
+ *       a lock-free queue and it's moved to the output queue of the connection
+ *       at the end of the current runcycle. If in the meanwhile the connection
+ *       has been closed (even if its fd has been reused) or the output budget
+ *       rejects it, the data is silently dropped (and released through the
+ *       mux_free_data callback of the connection if mode requires it).
+ *       A connection moved to another mux (see iomux_move_fd()) keeps its id,
+ *       but the data written through the old mux is dropped as well
+ */
+int iomux_write_async(iomux_t *iomux, iomux_conn_id_t id, unsigned char *data, int len, iomux_output_mode_t mode);
+
+/**
+ * @brief Queue a datagram to be sent to a specific destination
+ * @param iomux A valid iomux handler
+ * @param fd The datagram socket we want to send the datagram from
+ * @param data The datagram payload
+ * @param len The length of the payload
+ * @param mode the iomux_output_mode which determines if the data has to be copied,
+ *             freed or ignored (in which case the caller needs to take care of releasing
+ *             the underlying memory)
+ * @param addr The destination address (NULL for connected sockets)
+ * @param addrlen The size of the destination address
+ * @returns The number of queued bytes
+ * @note On filedescriptors registered with a mux_datagram callback each chunk
+ *       queued using iomux_write() or iomux_sendto() is sent as one datagram.
+ *       Queued datagrams are flushed in batches (using sendmmsg() where available)
+ */
+int iomux_sendto(iomux_t *iomux, int fd, unsigned char *data, int len, iomux_output_mode_t mode,
+                 struct sockaddr *addr, socklen_t addrlen);
+
+/**
+ * @brief Get the amount of output queued for a managed filedescriptor
+ * @param iomux A valid iomux handler
+ * @param fd The fd to check
+ * @returns The number of bytes queued and not yet written; -1 if fd is not managed
+ */
+int iomux_pending_output(iomux_t *iomux, int fd);
+
+/**
+ * @brief Set the output watermarks for a managed filedescriptor
+ * @param iomux A valid iomux handler
+ * @param fd The fd to configure
+ * @param low The low watermark
+ * @param high The high watermark (0 disables the watermarks)
+ * @returns TRUE on success; FALSE otherwise
+ * @note When the output queued on fd reaches the high watermark the mux_output_full
+ *       callback is called, so that producers can stop writing. Once enough data
+ *       has been written for the queue to drop back to the low watermark, the
+ *       mux_output_drained callback is called and producers can resume.
+ */
+int iomux_set_output_watermarks(iomux_t *iomux, int fd, int low, int high);
+
+/**
+ * @brief Call the mux_output callbacks only when asked to
+ * @param iomux A valid iomux handler
+ * @param on If TRUE, mux_output is called only for the filedescriptors passed
+ *           to iomux_want_output() (once they are writable); if FALSE (the default)
+ *           mux_output is called at each runcycle for all the filedescriptors
+ *           with no queued output
+ * @note Should be called before adding any filedescriptor to the mux
+ */
+void iomux_set_output_on_demand(iomux_t *iomux, int on);
+
+/**
+ * @brief Notify the mux that the application has some output for a filedescriptor
+ * @param iomux A valid iomux handler
+ * @param fd The fd the application wants to write to
+ * @returns TRUE on success; FALSE otherwise
+ * @note The mux_output callback registered for fd will be called once, as soon as
+ *       fd is writable and there is no queued output. To be called again the
+ *       application needs to call iomux_want_output() again.
+ *       See iomux_set_output_on_demand()
+ */
+int iomux_want_output(iomux_t *iomux, int fd);
+
+/**
+ * @brief Configure the writable space hint passed to the mux_output callback
+ * @param iomux A valid iomux handler
+ * @param fd The fd to configure
+ * @param hint The number of bytes the application should provide at most,
+ *             IOMUX_OUTPUT_HINT_KERNEL to estimate it from the free space
+ *             in the socket send buffer (SO_SNDBUF minus SIOCOUTQ where available)
+ *             or 0 to disable the hint
+ * @returns TRUE on success; FALSE otherwise
+ * @note The output already queued for fd is subtracted from the hint.
+ *       While the resulting space is 0 mux_output is not called at all,
+ *       so the len passed to it is 0 only when no hint is configured
+ */
+int iomux_set_output_hint(iomux_t *iomux, int fd, int hint);
+
+/**
+ * @brief Set TCP_NOTSENT_LOWAT on a filedescriptor
+ * @param iomux A valid iomux handler
+ * @param fd The (TCP socket) fd to configure
+ * @param lowat The maximum number of unsent bytes for fd to be reported writable
+ * @returns TRUE on success; FALSE otherwise (or if not supported)
+ * @note Keeps the data waiting in the kernel to a minimum so that it can be
+ *       produced just in time by the mux_output callbacks
+ */
+int iomux_set_notsent_lowat(iomux_t *iomux, int fd, int lowat);
+
+/**
+ * @brief Get the cpu which processed the incoming packets of a connection
+ * @param iomux A valid iomux handler
+ * @param fd The connected socket
+ * @returns The cpu number (SO_INCOMING_CPU); -1 in case of errors or if not supported
+ */
+int iomux_incoming_cpu(iomux_t *iomux, int fd);
+
+/**
+ * @brief Limit the rate at which output is sent to a managed filedescriptor
+ * @param iomux A valid iomux handler
+ * @param fd The fd to pace
+ * @param rate The maximum rate in bytes per second (0 disables pacing)
+ * @param burst The maximum number of bytes which can be sent at once
+ *              (0 to use 10ms worth of data)
+ * @returns TRUE on success; FALSE otherwise
+ * @note The queued output is sent as allowed by a token bucket, the fd is polled
+ *       for output again once enough tokens have been collected.
+ *       Where supported, the rate is also set as SO_MAX_PACING_RATE on the socket
+ *       so that the kernel paces the packets as well
+ */
+int iomux_set_pacing_rate(iomux_t *iomux, int fd, uint64_t rate, uint64_t burst);
+
+/**
+ * @brief Stop reading from a managed filedescriptor
+ * @param iomux A valid iomux handler
+ * @param fd The fd to pause
+ * @returns TRUE on success; FALSE otherwise
+ * @note The fd is not polled for input anymore (so the kernel buffers fill up
+ *       and the sender is eventually pushed back) and the mux_input callback
+ *       won't be called, not even for data already buffered, until
+ *       iomux_resume_input() is called.
+ *       Input is also paused automatically, until the application consumes
+ *       some of it, when the connection input buffer is full.
+ */
+int iomux_pause_input(iomux_t *iomux, int fd);
+
+/**
+ * @brief Resume reading from a filedescriptor paused with iomux_pause_input()
+ * @param iomux A valid iomux handler
+ * @param fd The fd to resume
+ * @returns TRUE on success; FALSE otherwise
+ */
+int iomux_resume_input(iomux_t *iomux, int fd);
+
+/**
+ * @brief Set the maximum amount of output which can be queued on all the
+ *        filedescriptors managed by the iomux
+ * @param iomux A valid iomux handler
+ * @param budget The budget in bytes (0 means unlimited)
+ * @param policy What to do when a write would exceed the budget
+ * @note With IOMUX_BUDGET_POLICY_REJECT iomux_write() returns 0 and the caller
+ *       keeps the ownership of the data, mux_output callbacks aren't called
+ *       until the queued output drops below the budget.
+ *       With IOMUX_BUDGET_POLICY_DROP_OLDEST the oldest chunks of the largest
+ *       queues are dropped (partially written chunks are always preserved).
+ *       With IOMUX_BUDGET_POLICY_CLOSE_LARGEST the connections with the largest
+ *       queues are closed by the next iomux_run() until the output fits in the budget.
+ */
+void iomux_set_output_budget(iomux_t *iomux, size_t budget, iomux_budget_policy_t policy);
+
+/**
+ * @brief Register the callback which will be called when the output budget is exceeded
+ * @param iomux A valid iomux handler
+ * @param cb The callback
+ * @param priv A pointer which will be passed to the callback
+ * @note The callback is called before applying the policy so it can release
+ *       some of the queued output (or close some connections) itself
+ */
+void iomux_output_budget_cb(iomux_t *iomux, iomux_cb_t cb, void *priv);
+
+/**
+ * @brief Get the memory used by the iomux to hold input and output data
+ * @param iomux A valid iomux handler
+ * @param output If not NULL, the number of output bytes queued on all the connections
+ *               will be stored here
+ * @param input If not NULL, the number of bytes allocated for input buffers
+ *              will be stored here
+ */
+void iomux_memory_usage(iomux_t *iomux, size_t *output, size_t *input);
+
+/**
+ * @brief Hold the data queued for a managed filedescriptor until iomux_uncork() is called
+ * @param iomux A valid iomux handler
+ * @param fd The fd to cork
+ * @param timeout If not NULL, the fd will be automatically uncorked
+ *                when the (relative) timeout expires
+ * @returns TRUE on success; FALSE otherwise
+ * @note Useful when a message is built using multiple iomux_write() calls
+ *       (header, body, trailer...) since everything queued while corked
+ *       will be flushed at once. TCP_CORK is also set on TCP sockets
+ *       (TCP_NOPUSH where TCP_CORK is not available)
+ */
+int iomux_cork(iomux_t *iomux, int fd, struct timeval *timeout);
+
+/**
+ * @brief Flush the data queued for a corked filedescriptor
+ * @param iomux A valid iomux handler
+ * @param fd The fd to uncork
+ * @returns TRUE on success; FALSE if fd was not corked
+ * @note The mux tries to send all the queued chunks right away with a
+ *       single syscall and then clears TCP_CORK on the socket.
+ *       Whatever can't be sent immediately will be sent as soon as
+ *       the fd is writable again.
+ */
+int iomux_uncork(iomux_t *iomux, int fd);
+
 /**
  * @brief Set/Override the output callback for a managed filedescriptor
  * @param iomux A valid iomux handler
@@ -367,6 +905,28 @@ int iomux_num_fds(iomux_t *iomux);
 
 int iomux_move(iomux_t *src, iomux_t *dst);
 
+/**
+ * @brief Move a single connection from a mux to another one
+ * @param src The mux the fd is currently registered with
+ * @param dst The mux the fd will be registered with
+ * @param fd The fd to move
+ * @returns TRUE if the connection has been handed over to dst;
+ *          FALSE otherwise (the fd stays in the src mux)
+ * @note The connection is moved as a whole: callbacks, buffered input,
+ *       pending output, per-fd timeout and all the other settings.
+ *       It's removed from src right away but it's attached to dst by the
+ *       thread running it, at the end of its next runcycle (see iomux_post()).
+ *       If dst can't take it (the fd is already registered there) it's given
+ *       back to src the same way, if neither mux can take it mux_eof is called.
+ *       If dst is destroyed before attaching it, the connection is attached and
+ *       closed together with the other connections of dst.
+ *       It's safe to call when src and dst are run by different threads,
+ *       also from their callbacks, but not from the mux_input callback of
+ *       the fd being moved (whatever is being delivered would be delivered
+ *       again by dst)
+ */
+int iomux_move_fd(iomux_t *src, iomux_t *dst, int fd);
+
 #ifndef NO_PTHREAD
 typedef struct _iomtee_s iomtee_t;
 
@@ -407,6 +967,92 @@ void iomtee_add_fd(iomtee_t *tee, int fd);
  */
 void iomtee_remove_fd(iomtee_t *tee, int fd);
 
+typedef struct _iomux_group_s iomux_group_t;
+
+/**
+ * @brief Create a group of muxes, each one to be run by its own thread
+ * @param num_loops The number of muxes (0 to create one per cpu the process can run on)
+ * @param bufsize The bufsize passed to iomux_create() for each mux
+ * @return A valid group handler; NULL in case of errors
+ */
+iomux_group_t *iomux_group_create(int num_loops, int bufsize);
+
+/**
+ * @brief Get the number of muxes in the group
+ */
+int iomux_group_size(iomux_group_t *group);
+
+/**
+ * @brief Get one of the muxes in the group
+ * @param group A valid group handler
+ * @param index The index of the mux (from 0 to iomux_group_size() - 1)
+ * @return The mux at the given index; NULL if index is out of range
+ */
+iomux_t *iomux_group_get(iomux_group_t *group, int index);
+
+/**
+ * @brief Pin each mux thread to a cpu and steer the connections accordingly
+ * @param group A valid group handler
+ * @param on TRUE to pin the thread of the mux at index N to the N-th cpu the process
+ *           can run on (see sched_getaffinity()); FALSE to let them float
+ * @returns TRUE on success; FALSE if the group is running or cpu affinity is not supported
+ * @note Must be called before iomux_group_listen() and iomux_group_start().
+ *       The listening sockets created afterwards get a SO_ATTACH_REUSEPORT_CBPF program
+ *       selecting the socket (hence the mux) by the cpu which received the connection,
+ *       so that softirq processing, accept and all the callbacks run on the same core.
+ *       This works best with one mux per cpu (see iomux_group_create())
+ */
+int iomux_group_set_affinity(iomux_group_t *group, int on);
+
+/**
+ * @brief Let idle loop threads run the callbacks of the other muxes in the group
+ * @param group A valid group handler
+ * @param on TRUE to enable work stealing; FALSE to disable it
+ * @returns TRUE on success; FALSE if the group is running or the backend is not epoll
+ * @note Each mux is switched to the oneshot dispatch (see iomux_set_executor()):
+ *       the connections found ready by a loop are queued in its own deque
+ *       and a loop with nothing left to do steals them from the others.
+ *       A connection is dispatched by one thread at a time, so its callbacks
+ *       keep running in order, but not necessarily on the thread of its mux.
+ *       Must be called before iomux_group_start()
+ */
+int iomux_group_set_work_stealing(iomux_group_t *group, int on);
+
+/**
+ * @brief Listen on the given address with all the muxes in the group
+ * @param group A valid group handler
+ * @param addr The address to bind the listening sockets to
+ * @param addrlen The size of the address
+ * @param cbs The callbacks the listening sockets are added with
+ * @returns TRUE on success; FALSE otherwise (no sockets are left listening)
+ * @note A listening socket is created for each mux using SO_REUSEPORT so that
+ *       the kernel spreads the incoming connections among the muxes.
+ *       The listening sockets are removed from the muxes and closed by
+ *       iomux_group_destroy(), the mux_eof callback is not called for them
+ */
+int iomux_group_listen(iomux_group_t *group, struct sockaddr *addr, socklen_t addrlen, iomux_callbacks_t *cbs);
+
+/**
+ * @brief Start a thread running each mux in the group
+ * @returns TRUE on success; FALSE otherwise
+ * @note The muxes are run with iomux_loop_once(), so their loop_next and hangup
+ *       callbacks are called at each runcycle and the loop_end callback is called
+ *       when their loop is ended, either by iomux_end_loop() (the thread then goes on
+ *       running the mux) or by iomux_group_end_loop()
+ */
+int iomux_group_start(iomux_group_t *group);
+
+/**
+ * @brief Stop all the threads started by iomux_group_start()
+ * @note Waits for all the threads to exit
+ */
+void iomux_group_end_loop(iomux_group_t *group);
+
+/**
+ * @brief Stop the group and dispose all resources (including the muxes)
+ */
+void iomux_group_destroy(iomux_group_t *group);
+
 #endif
 
 #ifdef __cplusplus
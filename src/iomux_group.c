@@ -0,0 +1,486 @@
+#ifndef NO_PTHREAD
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#if defined(__linux__)
+#include <linux/filter.h>
+#endif
+
+#include "bsd_queue.h"
+#include "iomux.h"
+
+// maximum number of queued connections a loop executes before polling its mux again
+#define IOMUX_GROUP_BATCH (64)
+
+typedef struct _iomux_group_listener_s {
+    iomux_t *iomux;
+    int fd;
+    TAILQ_ENTRY(_iomux_group_listener_s) next;
+} iomux_group_listener_t;
+
+//! \brief a connection handed to the executor (see iomux_set_executor())
+typedef struct _iomux_group_task_s {
+    iomux_t *iomux;
+    iomux_conn_id_t id;
+    uint32_t events;
+} iomux_group_task_t;
+
+//! \brief ring of tasks, the owning loop takes the oldest ones
+//!        while the other loops steal the newest ones
+typedef struct _iomux_group_deque_s {
+    pthread_mutex_t lock;
+    iomux_group_task_t *tasks;
+    int size;
+    int head;
+    int count;
+} iomux_group_deque_t;
+
+typedef struct _iomux_group_loop_s {
+    iomux_group_t *group;
+    iomux_t *iomux;
+    pthread_t th;
+    int cpu;
+    iomux_group_deque_t deque;
+    int idle; // waiting for events on its own mux
+} iomux_group_loop_t;
+
+struct _iomux_group_s {
+    iomux_group_loop_t *loops;
+    int num_loops;
+    int num_cpus; // distinct cpus the loops are pinned to (see iomux_group_set_affinity())
+    TAILQ_HEAD(, _iomux_group_listener_s) listeners;
+    int running;
+    int leave;
+    int affinity;
+    int stealing;
+};
+
+static void group_wakeup(iomux_t *iomux, void *priv) {
+    // nothing to do, iomux_post() woke up the loop already
+}
+
+static int group_deque_push(iomux_group_deque_t *deque, iomux_group_task_t *task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->size) {
+        int size = deque->size ? deque->size * 2 : 64;
+        iomux_group_task_t *tasks = malloc(size * sizeof(iomux_group_task_t));
+        if (!tasks) {
+            pthread_mutex_unlock(&deque->lock);
+            return 0;
+        }
+        int i;
+        for (i = 0; i < deque->count; i++)
+            tasks[i] = deque->tasks[(deque->head + i) % deque->size];
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->size = size;
+        deque->head = 0;
+    }
+    deque->tasks[(deque->head + deque->count) % deque->size] = *task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return 1;
+}
+
+static int group_deque_pop(iomux_group_deque_t *deque, iomux_group_task_t *task, int newest)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (!deque->count) {
+        pthread_mutex_unlock(&deque->lock);
+        return 0;
+    }
+    if (newest) {
+        *task = deque->tasks[(deque->head + deque->count - 1) % deque->size];
+    } else {
+        *task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->size;
+    }
+    deque->count--;
+    pthread_mutex_unlock(&deque->lock);
+    return 1;
+}
+
+// NOTE - executor callback of the muxes in a work stealing group,
+//        called by iomux_run() on the loop owning the mux
+static int group_queue(iomux_t *iomux, iomux_conn_id_t id, uint32_t events, void *priv)
+{
+    iomux_group_loop_t *loop = (iomux_group_loop_t *)priv;
+    iomux_group_task_t task = { iomux, id, events };
+    return group_deque_push(&loop->deque, &task);
+}
+
+// NOTE - runs the tasks queued by the last runcycle of the loop or, if there
+//        were none, one task stolen from another loop.
+//        Returns TRUE if something has been done (there might be more to do)
+static int group_work(iomux_group_loop_t *loop)
+{
+    iomux_group_t *group = loop->group;
+    int index = loop - group->loops;
+    iomux_group_task_t task;
+    int i;
+
+    // wake up the idle loops so that they can steal the backlog
+    pthread_mutex_lock(&loop->deque.lock);
+    int backlog = loop->deque.count - 1;
+    pthread_mutex_unlock(&loop->deque.lock);
+    for (i = 1; i < group->num_loops && backlog > 0; i++) {
+        iomux_group_loop_t *peer = &group->loops[(index + i) % group->num_loops];
+        if (__sync_bool_compare_and_swap(&peer->idle, 1, 0)) {
+            iomux_post(peer->iomux, group_wakeup, NULL);
+            backlog--;
+        }
+    }
+
+    int done = 0;
+    while (done < IOMUX_GROUP_BATCH && group_deque_pop(&loop->deque, &task, 0)) {
+        iomux_execute(task.iomux, task.id, task.events);
+        done++;
+    }
+    if (done)
+        return 1;
+
+    for (i = 1; i < group->num_loops; i++) {
+        iomux_group_loop_t *peer = &group->loops[(index + i) % group->num_loops];
+        if (group_deque_pop(&peer->deque, &task, 1)) {
+            iomux_execute(task.iomux, task.id, task.events);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *group_run(void *arg) {
+    struct timeval tv = { 0, 50000 };
+    struct timeval poll_tv = { 0, 0 };
+    iomux_group_loop_t *loop = (iomux_group_loop_t *)arg;
+#if defined(__linux__)
+    if (loop->group->affinity) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(loop->cpu, &cpus);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (rc != 0)
+            fprintf(stderr, "Can't pin the loop thread to cpu %d : %s\n", loop->cpu, strerror(rc));
+    }
+#endif
+    // NOTE: while there is work around the mux is just polled,
+    //       otherwise the loop waits for events and can be woken up to steal
+    int busy = 0;
+    while (!__sync_fetch_and_add(&loop->group->leave, 0)) {
+        if (!loop->group->stealing) {
+            iomux_loop_once(loop->iomux, &tv);
+            continue;
+        }
+        if (!busy)
+            (void)__sync_lock_test_and_set(&loop->idle, 1);
+        iomux_loop_once(loop->iomux, busy ? &poll_tv : &tv);
+        (void)__sync_lock_test_and_set(&loop->idle, 0);
+        busy = group_work(loop);
+    }
+
+    // the loop_end callback runs as if iomux_loop() was returning
+    iomux_end_loop(loop->iomux);
+    iomux_loop_once(loop->iomux, &tv);
+    return NULL;
+}
+
+iomux_group_t *iomux_group_create(int num_loops, int bufsize)
+{
+    if (num_loops <= 0) {
+#if defined(__linux__)
+        cpu_set_t cpus;
+        long ncpus = (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) ? CPU_COUNT(&cpus) : 0;
+#else
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        num_loops = ncpus > 0 ? ncpus : 1;
+    }
+
+    iomux_group_t *group = calloc(1, sizeof(iomux_group_t));
+    if (!group) {
+        fprintf(stderr, "Can't allocate the iomux group : %s\n", strerror(errno));
+        return NULL;
+    }
+    TAILQ_INIT(&group->listeners);
+
+    group->loops = calloc(num_loops, sizeof(iomux_group_loop_t));
+    if (!group->loops) {
+        fprintf(stderr, "Can't allocate the iomux group loops : %s\n", strerror(errno));
+        free(group);
+        return NULL;
+    }
+
+    int i;
+    for (i = 0; i < num_loops; i++) {
+        group->loops[i].group = group;
+        group->loops[i].cpu = i;
+        group->loops[i].iomux = iomux_create(bufsize, 1);
+        if (!group->loops[i].iomux) {
+            iomux_group_destroy(group);
+            return NULL;
+        }
+        pthread_mutex_init(&group->loops[i].deque.lock, NULL);
+        group->num_loops++;
+    }
+    return group;
+}
+
+int iomux_group_size(iomux_group_t *group)
+{
+    return group->num_loops;
+}
+
+iomux_t *iomux_group_get(iomux_group_t *group, int index)
+{
+    if (index < 0 || index >= group->num_loops)
+        return NULL;
+    return group->loops[index].iomux;
+}
+
+int iomux_group_set_affinity(iomux_group_t *group, int on)
+{
+    if (group->running)
+        return 0;
+#if defined(__linux__)
+    if (on) {
+        cpu_set_t cpus;
+        if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0 || !CPU_COUNT(&cpus)) {
+            fprintf(stderr, "Can't get the cpus available to the process : %s\n", strerror(errno));
+            return 0;
+        }
+        // the loops are pinned to the available cpus in order,
+        // starting over if there are more loops than cpus
+        group->num_cpus = CPU_COUNT(&cpus);
+        int cpu = 0;
+        int i;
+        for (i = 0; i < group->num_loops; cpu = (cpu + 1) % CPU_SETSIZE) {
+            if (CPU_ISSET(cpu, &cpus))
+                group->loops[i++].cpu = cpu;
+        }
+    }
+    group->affinity = on;
+    return 1;
+#else
+    return !on;
+#endif
+}
+
+int iomux_group_set_work_stealing(iomux_group_t *group, int on)
+{
+    if (group->running)
+        return 0;
+
+    int i;
+    for (i = 0; i < group->num_loops; i++) {
+        iomux_t *iomux = group->loops[i].iomux;
+        if (!iomux_set_oneshot(iomux, on) ||
+            !iomux_set_executor(iomux, on ? group_queue : NULL, &group->loops[i]))
+        {
+            fprintf(stderr, "Can't set up the executor of loop %d\n", i);
+            // put back the muxes already switched
+            while (i--) {
+                iomux_set_executor(group->loops[i].iomux, NULL, NULL);
+                iomux_set_oneshot(group->loops[i].iomux, 0);
+            }
+            return 0;
+        }
+    }
+    group->stealing = on;
+    return 1;
+}
+
+// NOTE - selects the listening socket by the cpu which received the connection
+//        (socket N of the reuseport group is served by the loop pinned to the
+//        cpu matched by the N-th test, cpus without a loop are spread among all)
+static int group_attach_cpu_filter(iomux_group_t *group, int fd)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+    int tests = group->num_cpus < group->num_loops ? group->num_cpus : group->num_loops;
+    if (tests > (BPF_MAXINSNS - 3) / 2)
+        tests = (BPF_MAXINSNS - 3) / 2;
+    int len = 2 * tests + 3;
+    struct sock_filter *code = calloc(len, sizeof(struct sock_filter));
+    if (!code) {
+        fprintf(stderr, "Can't allocate the reuseport cpu filter : %s\n", strerror(errno));
+        return 0;
+    }
+
+    code[0] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    int i;
+    for (i = 0; i < tests; i++) {
+        code[1 + 2 * i] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, group->loops[i].cpu, 0, 1);
+        code[2 + 2 * i] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[len - 2] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, group->num_loops);
+    code[len - 1] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    struct sock_fprog prog = {
+        .len = len,
+        .filter = code
+    };
+    int rc = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+    if (rc != 0)
+        fprintf(stderr, "Can't attach the reuseport cpu filter : %s\n", strerror(errno));
+    free(code);
+    return (rc == 0);
+#else
+    fprintf(stderr, "SO_ATTACH_REUSEPORT_CBPF is not supported\n");
+    return 0;
+#endif
+}
+
+// NOTE - removes listener and all the ones added after it
+//        (used to undo a failed iomux_group_listen())
+static void group_unlisten(iomux_group_t *group, iomux_group_listener_t *listener)
+{
+    while (listener) {
+        iomux_group_listener_t *next = TAILQ_NEXT(listener, next);
+        TAILQ_REMOVE(&group->listeners, listener, next);
+        iomux_remove(listener->iomux, listener->fd);
+        close(listener->fd);
+        free(listener);
+        listener = next;
+    }
+}
+
+int iomux_group_listen(iomux_group_t *group, struct sockaddr *addr, socklen_t addrlen, iomux_callbacks_t *cbs)
+{
+#if defined(SO_REUSEPORT)
+    iomux_group_listener_t *first = NULL;
+    int i;
+    for (i = 0; i < group->num_loops; i++) {
+        int fd = socket(addr->sa_family, SOCK_STREAM, 0);
+        if (fd == -1) {
+            fprintf(stderr, "Can't create the listening socket : %s\n", strerror(errno));
+            group_unlisten(group, first);
+            return 0;
+        }
+
+        // NOTE: each loop gets its own listening socket bound to the same
+        //       address, the kernel spreads the incoming connections among them
+        int val = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) != 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) != 0 ||
+            bind(fd, addr, addrlen) != 0)
+        {
+            fprintf(stderr, "Can't bind the listening socket : %s\n", strerror(errno));
+            close(fd);
+            group_unlisten(group, first);
+            return 0;
+        }
+
+        iomux_t *iomux = group->loops[i].iomux;
+        if (!iomux_add(iomux, fd, cbs) || !iomux_listen(iomux, fd)) {
+            fprintf(stderr, "Can't listen on fd %d\n", fd);
+            iomux_remove(iomux, fd);
+            close(fd);
+            group_unlisten(group, first);
+            return 0;
+        }
+
+        iomux_group_listener_t *listener = calloc(1, sizeof(iomux_group_listener_t));
+        if (!listener) {
+            fprintf(stderr, "Can't allocate the listener : %s\n", strerror(errno));
+            iomux_remove(iomux, fd);
+            close(fd);
+            group_unlisten(group, first);
+            return 0;
+        }
+        listener->iomux = iomux;
+        listener->fd = fd;
+        TAILQ_INSERT_TAIL(&group->listeners, listener, next);
+        if (!first)
+            first = listener;
+    }
+
+    // NOTE: the program applies to the whole reuseport group,
+    //       attaching it once all the sockets are listening keeps their order
+    if (group->affinity && !group_attach_cpu_filter(group, first->fd)) {
+        group_unlisten(group, first);
+        return 0;
+    }
+
+    return 1;
+#else
+    fprintf(stderr, "SO_REUSEPORT is not supported\n");
+    return 0;
+#endif
+}
+
+int iomux_group_start(iomux_group_t *group)
+{
+    if (group->running)
+        return 0;
+
+    group->leave = 0;
+    int i;
+    for (i = 0; i < group->num_loops; i++) {
+        int rc = pthread_create(&group->loops[i].th, NULL, group_run, &group->loops[i]);
+        if (rc != 0) {
+            fprintf(stderr, "Can't start the loop thread : %s\n", strerror(rc));
+            (void)__sync_add_and_fetch(&group->leave, 1);
+            while (i--)
+                pthread_join(group->loops[i].th, NULL);
+            return 0;
+        }
+    }
+    group->running = 1;
+    return 1;
+}
+
+void iomux_group_end_loop(iomux_group_t *group)
+{
+    if (!group->running)
+        return;
+
+    (void)__sync_add_and_fetch(&group->leave, 1);
+    int i;
+    for (i = 0; i < group->num_loops; i++)
+        iomux_post(group->loops[i].iomux, group_wakeup, NULL);
+    for (i = 0; i < group->num_loops; i++)
+        pthread_join(group->loops[i].th, NULL);
+    group->running = 0;
+
+    // the connections still queued must be dispatched
+    // or they would never be polled again
+    iomux_group_task_t task;
+    for (i = 0; i < group->num_loops; i++) {
+        while (group_deque_pop(&group->loops[i].deque, &task, 0))
+            iomux_execute(task.iomux, task.id, task.events);
+    }
+}
+
+void iomux_group_destroy(iomux_group_t *group)
+{
+    iomux_group_end_loop(group);
+
+    // NOTE: the listeners are removed before destroying the muxes,
+    //       which would call mux_eof on them (and the fds are ours to close)
+    group_unlisten(group, TAILQ_FIRST(&group->listeners));
+
+    int i;
+    for (i = 0; i < group->num_loops; i++) {
+        iomux_destroy(group->loops[i].iomux);
+        free(group->loops[i].deque.tasks);
+        pthread_mutex_destroy(&group->loops[i].deque.lock);
+    }
+
+    free(group->loops);
+    free(group);
+}
+
+#endif
@@ -1,3 +1,7 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -24,6 +28,11 @@
 #include <sys/types.h>
 
 #include <libgen.h>
+#include <sched.h>
+
+#ifndef NO_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "iomux.h"
 
@@ -269,6 +278,358 @@ int test_mtee_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *
     return len;
 }
 
+int test_count_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    int *count = (int *)priv;
+    if (len == 4 && memcmp(data, "CIAO", 4) == 0)
+        (*count)++;
+    iomux_end_loop(iomux);
+    return len;
+}
+
+struct {
+    int total;
+    int calls;
+    int expected;
+} bulk_context;
+
+int test_bulk_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    bulk_context.calls++;
+    bulk_context.total += len;
+    if (bulk_context.total >= bulk_context.expected)
+        iomux_end_loop(iomux);
+    return len;
+}
+
+struct {
+    unsigned char *buf;
+    int size;
+} take_context;
+
+int test_take_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    take_context.buf = iomux_input_take(iomux, fd, &take_context.size);
+    iomux_end_loop(iomux);
+    return 0;
+}
+
+void test_readable(iomux_t *iomux, int fd, void *priv)
+{
+    int *count = (int *)priv;
+    char buf[4];
+    if (read(fd, buf, sizeof(buf)) == 4 && memcmp(buf, "CIAO", 4) == 0)
+        (*count)++;
+    iomux_end_loop(iomux);
+}
+
+void test_datagram(iomux_t *iomux, int fd, unsigned char *data, int len,
+                   struct sockaddr *addr, socklen_t addrlen, void *priv)
+{
+    int *count = (int *)priv;
+    if (len == 4 && memcmp(data, "CIAO", 4) == 0 && addr->sa_family == AF_INET)
+        (*count)++;
+    if (*count == 3)
+        iomux_end_loop(iomux);
+}
+
+struct {
+    int full;
+    int drained;
+    int pending;
+} watermark_context;
+
+void test_output_full(iomux_t *iomux, int fd, int pending, void *priv)
+{
+    watermark_context.full++;
+    watermark_context.pending = pending;
+}
+
+void test_output_drained(iomux_t *iomux, int fd, int pending, void *priv)
+{
+    watermark_context.drained++;
+    watermark_context.pending = pending;
+    iomux_end_loop(iomux);
+}
+
+void test_budget(iomux_t *iomux, void *priv)
+{
+    int *count = (int *)priv;
+    (*count)++;
+}
+
+void test_group_connection(iomux_t *iomux, int fd, void *priv)
+{
+    int *count = (int *)priv;
+    __sync_add_and_fetch(count, 1);
+    close(fd);
+}
+
+int incoming_cpu = -2;
+int accepting_cpu = -3;
+
+void test_group_cpu(iomux_t *iomux, int fd, void *priv)
+{
+    int *count = (int *)priv;
+    incoming_cpu = iomux_incoming_cpu(iomux, fd);
+#if defined(__linux__)
+    accepting_cpu = sched_getcpu();
+#endif
+    __sync_add_and_fetch(count, 1);
+    close(fd);
+}
+
+int posted_order = 0;
+
+void test_post(iomux_t *iomux, void *priv)
+{
+    posted_order = posted_order * 10 + *(int *)priv;
+}
+
+void test_post_end(iomux_t *iomux, void *priv)
+{
+    iomux_end_loop(iomux);
+}
+
+typedef struct {
+    iomux_t *from;
+    iomux_t *to;
+    int fd;
+    int moves;
+    int done;
+} mover_context_t;
+
+int mover_leave = 0;
+
+int freed_data = 0;
+
+void test_free_data(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    freed_data++;
+    free(data);
+}
+
+// moves the fd back and forth between two muxes, always from
+// a callback running on the thread of the mux holding it
+void test_mover(iomux_t *iomux, void *priv)
+{
+    mover_context_t *ctx = (mover_context_t *)priv;
+    iomux_t *from = ctx->from;
+    if (!iomux_move_fd(from, ctx->to, ctx->fd) || ++ctx->moves == 1000) {
+        __sync_add_and_fetch(&ctx->done, 1);
+        return;
+    }
+    ctx->from = ctx->to;
+    ctx->to = from;
+    // runs once the connection has been attached
+    iomux_post(ctx->from, test_mover, ctx);
+}
+
+typedef struct {
+    iomux_t *mux;
+    iomux_conn_id_t id;
+    int written;
+} async_context_t;
+
+#ifndef NO_PTHREAD
+void *test_async_writer(void *arg)
+{
+    async_context_t *ctx = (async_context_t *)arg;
+    int i;
+    for (i = 0; i < 100; i++)
+        ctx->written += iomux_write_async(ctx->mux, ctx->id, (unsigned char *)"CIAO", 4, IOMUX_OUTPUT_MODE_NONE);
+    iomux_post(ctx->mux, test_post_end, NULL);
+    return NULL;
+}
+
+void *test_post_thread(void *arg)
+{
+    usleep(10000);
+    iomux_post((iomux_t *)arg, test_post_end, NULL);
+    return NULL;
+}
+
+void *test_mover_thread(void *arg)
+{
+    struct timeval tv = { 0, 10000 };
+    while (!__sync_fetch_and_add(&mover_leave, 0))
+        iomux_run((iomux_t *)arg, &tv);
+    return NULL;
+}
+#endif
+
+int oneshot_slow_fd = -1;
+int oneshot_active = 0;
+int oneshot_overlap = 0;
+int oneshot_leave = 0;
+int oneshot_slow_calls = 0;
+int oneshot_fast_calls = 0;
+int oneshot_fast_during_slow = 0;
+
+int test_oneshot_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    int i;
+    if (fd != oneshot_slow_fd) {
+        if (__sync_fetch_and_add(&oneshot_active, 0))
+            oneshot_fast_during_slow = 1;
+        __sync_add_and_fetch(&oneshot_fast_calls, 1);
+        return len;
+    }
+    if (__sync_add_and_fetch(&oneshot_active, 1) > 1)
+        oneshot_overlap = 1;
+    // hold the connection until the other one has been dispatched
+    // (a stalled mux would never do it, so give up after a while)
+    for (i = 0; i < 300 && !__sync_fetch_and_add(&oneshot_fast_calls, 0); i++)
+        usleep(10000);
+    __sync_sub_and_fetch(&oneshot_active, 1);
+    __sync_add_and_fetch(&oneshot_slow_calls, 1);
+    return len;
+}
+
+int stolen_done = 0;
+#ifndef NO_PTHREAD
+pthread_t stolen_threads[2];
+#endif
+
+int test_stolen_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    // keep the loop busy so that the other connection is left in its queue
+    usleep(200000);
+#ifndef NO_PTHREAD
+    stolen_threads[__sync_fetch_and_add(&stolen_done, 1) % 2] = pthread_self();
+#endif
+    return len;
+}
+
+#ifndef NO_PTHREAD
+void *test_oneshot_thread(void *arg)
+{
+    struct timeval tv = { 0, 20000 };
+    while (!__sync_fetch_and_add(&oneshot_leave, 0))
+        iomux_run((iomux_t *)arg, &tv);
+    return NULL;
+}
+#endif
+
+typedef struct {
+    iomux_t *mux;
+    int fd;
+    int write_rc;
+    int unknown_rc;
+    iomux_timeout_id_t timer;
+    int entered;
+    int done;
+    int done_in_callback;
+} busy_context_t;
+
+int test_slow_input(iomux_t *iomux, int fd, unsigned char *data, int len, void *priv)
+{
+    busy_context_t *ctx = (busy_context_t *)priv;
+    int i;
+    __sync_add_and_fetch(&ctx->entered, 1);
+    // hold the mux until the writer is done (a writer waiting
+    // for the lock would never be, so give up after a while)
+    for (i = 0; i < 300 && !__sync_fetch_and_add(&ctx->done, 0); i++)
+        usleep(10000);
+    ctx->done_in_callback = __sync_fetch_and_add(&ctx->done, 0);
+    return len;
+}
+
+int slow_timer_running = 0;
+int slow_timer_done = 0;
+
+void test_slow_timer(iomux_t *iomux, void *priv)
+{
+    __sync_add_and_fetch(&slow_timer_running, 1);
+    usleep(100000);
+    __sync_add_and_fetch(&slow_timer_done, 1);
+}
+
+#ifndef NO_PTHREAD
+void *test_timer_thread(void *arg)
+{
+    struct timeval tv = { 0, 10000 };
+    int i;
+    for (i = 0; i < 200 && !__sync_fetch_and_add(&slow_timer_done, 0); i++)
+        iomux_run((iomux_t *)arg, &tv);
+    return NULL;
+}
+
+void *test_busy_writer(void *arg)
+{
+    busy_context_t *ctx = (busy_context_t *)arg;
+    struct timeval timer_tv = { 10, 0 };
+    int i;
+    // let the loop thread enter the slow callback
+    for (i = 0; i < 300 && !__sync_fetch_and_add(&ctx->entered, 0); i++)
+        usleep(10000);
+    ctx->write_rc = iomux_write(ctx->mux, ctx->fd, "CIAO", 4, IOMUX_OUTPUT_MODE_COPY);
+    // fds not registered with the mux are still refused
+    ctx->unknown_rc = iomux_write(ctx->mux, ctx->fd + 1, "CIAO", 4, IOMUX_OUTPUT_MODE_COPY);
+    ctx->timer = iomux_schedule(ctx->mux, &timer_tv, test_post_end, NULL, NULL);
+    __sync_add_and_fetch(&ctx->done, 1);
+    return NULL;
+}
+#endif
+
+int output_hint = 0;
+
+void test_accept(iomux_t *iomux, int fd, struct sockaddr *addr, socklen_t addrlen, void *priv)
+{
+    int *count = (int *)priv;
+    // the connection has been already added using the listener template
+    if (addr->sa_family == AF_INET && iomux_callbacks(iomux, fd))
+        (*count)++;
+}
+
+iomux_output_mode_t test_output(iomux_t *iomux, int fd, unsigned char **data, int *len, void *priv)
+{
+    int *count = (int *)priv;
+    (*count)++;
+    output_hint = *len;
+    *data = (unsigned char *)"CIAO";
+    *len = 4;
+    iomux_end_loop(iomux);
+    return IOMUX_OUTPUT_MODE_NONE;
+}
+
+int group_loop_next = 0;
+int group_loop_end = 0;
+int group_listener_eof = 0;
+
+void test_group_loop_next(iomux_t *iomux, void *priv)
+{
+    __sync_add_and_fetch(&group_loop_next, 1);
+}
+
+void test_group_loop_end(iomux_t *iomux, void *priv)
+{
+    __sync_add_and_fetch(&group_loop_end, 1);
+}
+
+void test_group_eof(iomux_t *iomux, int fd, void *priv)
+{
+    __sync_add_and_fetch(&group_listener_eof, 1);
+}
+
+int moved_eof = 0;
+
+void test_moved_eof(iomux_t *iomux, int fd, void *priv)
+{
+    moved_eof++;
+}
+
+#ifndef NO_PTHREAD
+void *test_accept_thread(void *arg)
+{
+    // a single runcycle, the mux which doesn't get the connection
+    // returns only once the timeout expires
+    struct timeval tv = { 0, 500000 };
+    iomux_run((iomux_t *)arg, &tv);
+    return NULL;
+}
+#endif
+
 int
 main(int argc, char **argv)
 {
@@ -356,6 +717,680 @@ main(int argc, char **argv)
     close(server);
     close(client);
 
+    int pcount = 0;
+    iomux_callbacks_t pcbs = {
+        .mux_input = test_count_input,
+        .priv = &pcount
+    };
+    int sp[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+
+    mux = iomux_create(0, 0);
+    ut_testing("iomux_set_input_pool(mux, 16)");
+    ut_validate_int(iomux_set_input_pool(mux, 16), 1);
+    iomux_add(mux, sp[0], &pcbs);
+
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (write(sp[1], "CIAO", 4) != 4) {
+            printf("Can't write to the socketpair: %s\n", strerror(errno));
+            exit(-1);
+        }
+        iomux_loop(mux, &tv);
+    }
+    ut_testing("input pool: data is delivered using pooled buffers");
+    ut_validate_int(pcount, 2);
+
+    unsigned char copybuf[4];
+    memcpy(copybuf, "CIAO", 4);
+    iomux_add(mux, sp[1], &pcbs);
+    ut_testing("iomux_write(mux, sp[1], copybuf, 4, IOMUX_OUTPUT_MODE_COPY)");
+    ut_validate_int(iomux_write(mux, sp[1], copybuf, 4, IOMUX_OUTPUT_MODE_COPY), 4);
+    // the data has been copied so the caller can reuse its buffer right away
+    memset(copybuf, 0, sizeof(copybuf));
+    iomux_loop(mux, &tv);
+    ut_testing("small COPY chunks are sent from the chunk itself");
+    ut_validate_int(pcount, 3);
+
+    int lp[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, lp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    unsigned char largebuf[1000];
+    for (i = 0; i < (int)sizeof(largebuf); i++)
+        largebuf[i] = i & 0xff;
+    iomux_add(mux, lp[1], &pcbs);
+    ut_testing("iomux_write(mux, lp[1], largebuf, 1000, IOMUX_OUTPUT_MODE_COPY)");
+    ut_validate_int(iomux_write(mux, lp[1], largebuf, sizeof(largebuf), IOMUX_OUTPUT_MODE_COPY), 1000);
+    memset(largebuf, 0, sizeof(largebuf));
+    iomux_run(mux, &tv);
+    unsigned char largeout[1000];
+    int largelen = 0;
+    while (largelen < (int)sizeof(largeout)) {
+        int rb = read(lp[0], largeout + largelen, sizeof(largeout) - largelen);
+        if (rb <= 0)
+            break;
+        largelen += rb;
+    }
+    int largeok = (largelen == sizeof(largeout));
+    for (i = 0; largeok && i < largelen; i++)
+        largeok = (largeout[i] == (i & 0xff));
+    ut_testing("large COPY chunks are sent from the chunk itself");
+    ut_validate_int(largeok, 1);
+    iomux_remove(mux, lp[1]);
+    close(lp[0]);
+    close(lp[1]);
+
+    ut_testing("iomux_cork(mux, sp[1], NULL)");
+    ut_validate_int(iomux_cork(mux, sp[1], NULL), 1);
+    iomux_write(mux, sp[1], "CI", 2, IOMUX_OUTPUT_MODE_NONE);
+    iomux_write(mux, sp[1], "A", 1, IOMUX_OUTPUT_MODE_NONE);
+    iomux_write(mux, sp[1], "O", 1, IOMUX_OUTPUT_MODE_NONE);
+    cnt = 0;
+    iomux_schedule(mux, &tv, test_timeout_nofd, &cnt, NULL);
+    iomux_loop(mux, &tv);
+    ut_testing("corked fd: nothing is sent before iomux_uncork()");
+    ut_validate_int(pcount, 3);
+    ut_testing("iomux_uncork(mux, sp[1])");
+    ut_validate_int(iomux_uncork(mux, sp[1]), 1);
+    iomux_loop(mux, &tv);
+    ut_testing("uncorked fd: the queued chunks are flushed together");
+    ut_validate_int(pcount, 4);
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    int csp[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, csp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 0);
+    iomux_add(mux, sp[0], &pcbs);
+    iomux_add(mux, csp[0], &pcbs);
+    struct timeval cork_short = { 0, 50000 };
+    struct timeval cork_long = { 0, 800000 };
+    struct timeval cork_wait = { 5, 0 };
+    struct timeval cork_poll = { 0, 0 };
+    iomux_cork(mux, sp[0], &cork_short);
+    iomux_cork(mux, csp[0], &cork_long);
+    iomux_write(mux, sp[0], "CIAO", 4, IOMUX_OUTPUT_MODE_NONE);
+    iomux_write(mux, csp[0], "CIAO", 4, IOMUX_OUTPUT_MODE_NONE);
+    // the first runcycle waits only until the earliest cork timeout
+    iomux_run(mux, &cork_wait);
+    iomux_run(mux, &cork_poll);
+    ut_testing("corked fds: each one is flushed at its own sub-second timeout");
+    int short_rb = recv(sp[1], copybuf, 4, MSG_DONTWAIT);
+    int long_rb = recv(csp[1], copybuf, 4, MSG_DONTWAIT);
+    if (short_rb == 4 && long_rb == -1)
+        ut_success();
+    else
+        ut_failure("received %d and %d bytes", short_rb, long_rb);
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+    close(csp[0]);
+    close(csp[1]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    pcount = 0;
+    mux = iomux_create(0, 0);
+    mux2 = iomux_create(0, 0);
+    iomux_add(mux, sp[0], &pcbs);
+    iomux_conn_id_t moved_id = iomux_connection_id(mux, sp[0]);
+    // queued but not yet written
+    iomux_write(mux, sp[0], "CIAO", 4, IOMUX_OUTPUT_MODE_NONE);
+    ut_testing("iomux_move_fd(mux, mux2, sp[0])");
+    ut_validate_int(iomux_move_fd(mux, mux2, sp[0]), 1);
+    ut_testing("iomux_move_fd(): the fd is no longer in the source mux");
+    ut_validate_int(iomux_callbacks(mux, sp[0]) == NULL && iomux_num_fds(mux) == 0, 1);
+    // the connection is attached by the runcycle of the destination mux
+    iomux_run(mux2, &tv);
+    ut_testing("iomux_move_fd(): the fd is registered with the destination mux");
+    ut_validate_int(iomux_callbacks(mux2, sp[0]) != NULL && iomux_num_fds(mux2) == 1, 1);
+    if (write(sp[1], "CIAO", 4) != 4) {
+        printf("Can't write to the socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    iomux_run(mux2, &tv);
+    ut_testing("iomux_move_fd(): input is delivered by the destination mux");
+    ut_validate_int(pcount, 1);
+    ut_testing("iomux_move_fd(): pending output is flushed by the destination mux");
+    memset(copybuf, 0, sizeof(copybuf));
+    if (read(sp[1], copybuf, 4) == 4)
+        ut_validate_buffer(copybuf, 4, "CIAO", 4);
+    else
+        ut_failure("Can't read the moved output: %s", strerror(errno));
+    iomux_write_async(mux, moved_id, "ABCD", 4, IOMUX_OUTPUT_MODE_COPY);
+    iomux_write_async(mux2, moved_id, "EFGH", 4, IOMUX_OUTPUT_MODE_COPY);
+    for (i = 0; i < 2; i++) {
+        iomux_run(mux, &tv);
+        iomux_run(mux2, &tv);
+    }
+    ut_testing("iomux_move_fd(): the connection id is valid only with the destination mux");
+    memset(copybuf, 0, sizeof(copybuf));
+    if (recv(sp[1], copybuf, 8, MSG_DONTWAIT) == 4)
+        ut_validate_buffer(copybuf, 4, "EFGH", 4);
+    else
+        ut_failure("Can't read the async output: %s", strerror(errno));
+    iomux_destroy(mux);
+    iomux_destroy(mux2);
+    close(sp[0]);
+    close(sp[1]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    iomux_callbacks_t mcbs = {
+        .mux_eof = test_moved_eof
+    };
+    mux = iomux_create(0, 0);
+    mux2 = iomux_create(0, 0);
+    iomux_add(mux, sp[0], &mcbs);
+    iomux_move_fd(mux, mux2, sp[0]);
+    // mux2 never runs, the connection is still on its way
+    iomux_destroy(mux2);
+    ut_testing("iomux_move_fd(): a connection not yet attached is closed with the destination mux");
+    ut_validate_int(moved_eof, 1);
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 0);
+    iomux_add(mux, sp[0], &pcbs);
+    iomux_conn_id_t conn_id = iomux_connection_id(mux, sp[0]);
+    ut_testing("iomux_connection_id(mux, sp[0])");
+    if (conn_id)
+        ut_success();
+    else
+        ut_failure("No id for a registered fd");
+    ut_testing("iomux_write_async(mux, conn_id, \"CIAO\", 4, IOMUX_OUTPUT_MODE_COPY)");
+    ut_validate_int(iomux_write_async(mux, conn_id, "CIAO", 4, IOMUX_OUTPUT_MODE_COPY), 4);
+    iomux_run(mux, &tv);
+    iomux_run(mux, &tv);
+    ut_testing("iomux_write_async(): the data is written by the loop");
+    memset(copybuf, 0, sizeof(copybuf));
+    if (recv(sp[1], copybuf, 4, MSG_DONTWAIT) == 4)
+        ut_validate_buffer(copybuf, 4, "CIAO", 4);
+    else
+        ut_failure("Can't read the async output: %s", strerror(errno));
+    // the fd is registered again, the old id must not match the new connection
+    iomux_remove(mux, sp[0]);
+    iomux_add(mux, sp[0], &pcbs);
+    ut_testing("iomux_connection_id() changes when the fd is reused");
+    ut_validate_int(iomux_connection_id(mux, sp[0]) != conn_id, 1);
+    ut_testing("iomux_write_async(): writes to a stale connection id are refused");
+    ut_validate_int(iomux_write_async(mux, conn_id, "CIAO", 4, IOMUX_OUTPUT_MODE_COPY), 0);
+    iomux_run(mux, &tv);
+    iomux_run(mux, &tv);
+    ut_testing("iomux_write_async(): nothing is written for a stale connection id");
+    ut_validate_int(recv(sp[1], copybuf, 4, MSG_DONTWAIT), -1);
+    iomux_remove(mux, sp[0]);
+    iomux_callbacks_t fcbs = {
+        .mux_free_data = test_free_data
+    };
+    iomux_add(mux, sp[0], &fcbs);
+    conn_id = iomux_connection_id(mux, sp[0]);
+    unsigned char *freebuf = malloc(4);
+    memcpy(freebuf, "CIAO", 4);
+    iomux_write_async(mux, conn_id, freebuf, 4, IOMUX_OUTPUT_MODE_FREE);
+    // the connection is gone before the loop thread queues the data
+    iomux_remove(mux, sp[0]);
+    iomux_run(mux, &tv);
+    ut_testing("iomux_write_async(): dropped data is released through mux_free_data");
+    ut_validate_int(freed_data, 1);
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    iomux_callbacks_t bcbs = {
+        .mux_input = test_bulk_input
+    };
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    unsigned char bulk[32768];
+    memset(bulk, 'x', sizeof(bulk));
+    bulk_context.expected = sizeof(bulk);
+    if (write(sp[1], bulk, sizeof(bulk)) != sizeof(bulk)) {
+        printf("Can't write to the socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+
+    mux = iomux_create(1024, 0);
+    iomux_add(mux, sp[0], &bcbs);
+    iomux_loop(mux, &tv);
+    ut_testing("read overflow: %d bytes delivered with a 1024 bytes bufsize", sizeof(bulk));
+    ut_validate_int(bulk_context.total, sizeof(bulk));
+    ut_testing("read overflow: bulk data delivered with a single callback");
+    ut_validate_int(bulk_context.calls, 1);
+
+    iomux_callbacks_t *tcbs = iomux_callbacks(mux, sp[0]);
+    tcbs->mux_input = test_take_input;
+    if (write(sp[1], "CIAO", 4) != 4) {
+        printf("Can't write to the socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    iomux_loop(mux, &tv);
+    ut_testing("iomux_input_take() returns the buffer holding the input");
+    if (take_context.buf && take_context.size >= 4)
+        ut_validate_buffer(take_context.buf, 4, "CIAO", 4);
+    else
+        ut_failure("No buffer has been taken");
+    ut_testing("iomux_input_take(): small input read into the overflow buffer comes in a regular buffer");
+    ut_validate_int(take_context.size, 1024);
+    ut_testing("iomux_input_take() outside of mux_input returns NULL");
+    ut_validate_int(iomux_input_take(mux, sp[0], NULL) == NULL, 1);
+    iomux_input_release(mux, take_context.buf, take_context.size);
+
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    int rcount = 0;
+    iomux_callbacks_t rcbs = {
+        .mux_readable = test_readable,
+        .priv = &rcount
+    };
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 0);
+    iomux_add(mux, sp[0], &rcbs);
+    if (write(sp[1], "CIAO", 4) != 4) {
+        printf("Can't write to the socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    iomux_loop(mux, &tv);
+    ut_testing("raw mode: mux_readable reads the data itself");
+    ut_validate_int(rcount, 1);
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    int dcount = 0;
+    iomux_callbacks_t dcbs = {
+        .mux_datagram = test_datagram,
+        .priv = &dcount
+    };
+    struct sockaddr_in daddr;
+    socklen_t daddrlen = sizeof(daddr);
+    memset(&daddr, 0, sizeof(daddr));
+    daddr.sin_family = AF_INET;
+    daddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int dserver = socket(AF_INET, SOCK_DGRAM, 0);
+    int dclient = socket(AF_INET, SOCK_DGRAM, 0);
+    if (bind(dserver, (struct sockaddr *)&daddr, sizeof(daddr)) != 0 ||
+        getsockname(dserver, (struct sockaddr *)&daddr, &daddrlen) != 0)
+    {
+        printf("Can't bind the datagram socket: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 0);
+    iomux_add(mux, dserver, &dcbs);
+    iomux_add(mux, dclient, &dcbs);
+    ut_testing("iomux_sendto(mux, dclient, ...) x 3");
+    for (i = 0; i < 3; i++) {
+        if (iomux_sendto(mux, dclient, "CIAO", 4, IOMUX_OUTPUT_MODE_NONE, (struct sockaddr *)&daddr, daddrlen) != 4)
+            break;
+    }
+    ut_validate_int(i, 3);
+    iomux_loop(mux, &tv);
+    ut_testing("datagram mode: each datagram is delivered separately");
+    ut_validate_int(dcount, 3);
+    iomux_destroy(mux);
+    close(dserver);
+    close(dclient);
+
+    iomux_callbacks_t wcbs = {
+        .mux_output_full = test_output_full,
+        .mux_output_drained = test_output_drained
+    };
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 0);
+    iomux_add(mux, sp[1], &wcbs);
+    ut_testing("iomux_set_output_watermarks(mux, sp[1], 4, 8)");
+    ut_validate_int(iomux_set_output_watermarks(mux, sp[1], 4, 8), 1);
+    iomux_cork(mux, sp[1], NULL);
+    for (i = 0; i < 4; i++)
+        iomux_write(mux, sp[1], "CIAO", 4, IOMUX_OUTPUT_MODE_NONE);
+    ut_testing("iomux_pending_output(mux, sp[1]) == 16");
+    ut_validate_int(iomux_pending_output(mux, sp[1]), 16);
+    ut_testing("mux_output_full called once when reaching the high watermark");
+    if (watermark_context.full == 1)
+        ut_validate_int(watermark_context.pending, 8);
+    else
+        ut_failure("mux_output_full called %d times", watermark_context.full);
+    iomux_uncork(mux, sp[1]);
+    iomux_loop(mux, &tv);
+    ut_testing("mux_output_drained called once the queue has been flushed");
+    ut_validate_int(watermark_context.drained, 1);
+    ut_testing("iomux_pending_output(mux, sp[1]) == 0");
+    ut_validate_int(iomux_pending_output(mux, sp[1]), 0);
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    int bcount = 0;
+    size_t queued = 0;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 0);
+    iomux_add(mux, sp[1], &wcbs);
+    iomux_cork(mux, sp[1], NULL);
+    iomux_set_output_budget(mux, 8, IOMUX_BUDGET_POLICY_REJECT);
+    iomux_output_budget_cb(mux, test_budget, &bcount);
+    iomux_write(mux, sp[1], "CIAO", 4, IOMUX_OUTPUT_MODE_NONE);
+    iomux_write(mux, sp[1], "CIAO", 4, IOMUX_OUTPUT_MODE_NONE);
+    ut_testing("output budget: writes exceeding the budget are rejected");
+    ut_validate_int(iomux_write(mux, sp[1], "CIAO", 4, IOMUX_OUTPUT_MODE_NONE), 0);
+    ut_testing("iomux_memory_usage() reports the queued output");
+    iomux_memory_usage(mux, &queued, NULL);
+    ut_validate_int(queued, 8);
+    iomux_set_output_budget(mux, 8, IOMUX_BUDGET_POLICY_DROP_OLDEST);
+    ut_testing("output budget: the oldest chunks are dropped");
+    iomux_write(mux, sp[1], "ABCD", 4, IOMUX_OUTPUT_MODE_NONE);
+    iomux_memory_usage(mux, &queued, NULL);
+    ut_validate_int(queued, 8);
+    ut_testing("output budget: the callback is called when exceeding the budget");
+    ut_validate_int(bcount, 2);
+    iomux_uncork(mux, sp[1]);
+    char budgetbuf[8];
+    ut_testing("output budget: the newest chunks are delivered");
+    if (read(sp[0], budgetbuf, sizeof(budgetbuf)) == sizeof(budgetbuf))
+        ut_validate_buffer(budgetbuf, 8, "CIAOABCD", 8);
+    else
+        ut_failure("Can't read the queued output");
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    pcount = 0;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 0);
+    iomux_add(mux, sp[0], &pcbs);
+    ut_testing("iomux_pause_input(mux, sp[0])");
+    ut_validate_int(iomux_pause_input(mux, sp[0]), 1);
+    if (write(sp[1], "CIAO", 4) != 4) {
+        printf("Can't write to the socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    iomux_schedule(mux, &tv, test_timeout_nofd, &cnt, NULL);
+    iomux_loop(mux, &tv);
+    ut_testing("paused fd: no input is delivered");
+    ut_validate_int(pcount, 0);
+    ut_testing("iomux_resume_input(mux, sp[0])");
+    ut_validate_int(iomux_resume_input(mux, sp[0]), 1);
+    iomux_loop(mux, &tv);
+    ut_testing("resumed fd: the pending input is delivered");
+    ut_validate_int(pcount, 1);
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 0);
+    iomux_add(mux, sp[1], &wcbs);
+    iomux_cork(mux, sp[1], NULL);
+    // the queue fills the budget, replacing an update doesn't make it grow
+    iomux_set_output_budget(mux, 8, IOMUX_BUDGET_POLICY_REJECT);
+    iomux_write_keyed(mux, sp[1], 1, "AAAA", 4, IOMUX_OUTPUT_MODE_NONE);
+    iomux_write_keyed(mux, sp[1], 2, "BBBB", 4, IOMUX_OUTPUT_MODE_NONE);
+    ut_testing("iomux_write_keyed(): only the size difference counts against the output budget");
+    ut_validate_int(iomux_write_keyed(mux, sp[1], 1, "CIAO", 4, IOMUX_OUTPUT_MODE_NONE), 4);
+    ut_testing("iomux_write_keyed() replaces the queued update for the same key");
+    ut_validate_int(iomux_pending_output(mux, sp[1]), 8);
+    iomux_uncork(mux, sp[1]);
+    ut_testing("iomux_write_keyed() keeps the position of the replaced update");
+    if (read(sp[0], budgetbuf, sizeof(budgetbuf)) == sizeof(budgetbuf))
+        ut_validate_buffer(budgetbuf, 8, "CIAOBBBB", 8);
+    else
+        ut_failure("Can't read the queued output");
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 0);
+    iomux_add(mux, sp[1], &wcbs);
+    iomux_cork(mux, sp[1], NULL);
+    iomux_write(mux, sp[1], "BULK", 4, IOMUX_OUTPUT_MODE_NONE);
+    ut_testing("iomux_write_priority(mux, sp[1], \"CIAO\", 4, IOMUX_OUTPUT_MODE_NONE, IOMUX_PRIORITY_HIGH)");
+    ut_validate_int(iomux_write_priority(mux, sp[1], "CIAO", 4, IOMUX_OUTPUT_MODE_NONE, IOMUX_PRIORITY_HIGH), 4);
+    iomux_uncork(mux, sp[1]);
+    ut_testing("high priority chunks are sent first");
+    if (read(sp[0], budgetbuf, sizeof(budgetbuf)) == sizeof(budgetbuf))
+        ut_validate_buffer(budgetbuf, 8, "CIAOBULK", 8);
+    else
+        ut_failure("Can't read the queued output");
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 0);
+    iomux_add(mux, sp[1], &wcbs);
+    ut_testing("iomux_set_pacing_rate(mux, sp[1], 40960, 4096)");
+    ut_validate_int(iomux_set_pacing_rate(mux, sp[1], 40960, 4096), 1);
+    iomux_write(mux, sp[1], bulk, 8192, IOMUX_OUTPUT_MODE_NONE);
+    iomux_run(mux, &tv);
+    ut_testing("paced fd: only the burst is sent right away");
+    ut_validate_int(iomux_pending_output(mux, sp[1]), 4096);
+    struct timeval pacing_tv = { 0, 300000 };
+    iomux_schedule(mux, &pacing_tv, test_timeout_nofd, &cnt, NULL);
+    iomux_loop(mux, &tv);
+    ut_testing("paced fd: the rest is sent once the token bucket refills");
+    ut_validate_int(iomux_pending_output(mux, sp[1]), 0);
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, csp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 0);
+    iomux_add(mux, sp[1], &wcbs);
+    iomux_add(mux, csp[1], &wcbs);
+    // once empty, the first bucket refills in 100ms, the second one in 800ms
+    iomux_set_pacing_rate(mux, sp[1], 40960, 4096);
+    iomux_set_pacing_rate(mux, csp[1], 5000, 4096);
+    iomux_write(mux, sp[1], bulk, 8192, IOMUX_OUTPUT_MODE_NONE);
+    iomux_write(mux, csp[1], bulk, 8192, IOMUX_OUTPUT_MODE_NONE);
+    // poll until both buckets are empty and the fds are waiting for the refill
+    int paced_short = iomux_pending_output(mux, sp[1]);
+    int paced_long = iomux_pending_output(mux, csp[1]);
+    for (i = 0; i < 100; i++) {
+        int short_before = paced_short;
+        int long_before = paced_long;
+        iomux_run(mux, &cork_poll);
+        paced_short = iomux_pending_output(mux, sp[1]);
+        paced_long = iomux_pending_output(mux, csp[1]);
+        if (paced_short == short_before && paced_long == long_before)
+            break;
+    }
+    // the runcycle waits only until the earliest refill
+    iomux_run(mux, &cork_wait);
+    iomux_run(mux, &cork_poll);
+    ut_testing("paced fds: each one is woken up at its own sub-second refill");
+    if (iomux_pending_output(mux, sp[1]) < paced_short && iomux_pending_output(mux, csp[1]) == paced_long)
+        ut_success();
+    else
+        ut_failure("pending output %d -> %d and %d -> %d", paced_short, iomux_pending_output(mux, sp[1]),
+                   paced_long, iomux_pending_output(mux, csp[1]));
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+    close(csp[0]);
+    close(csp[1]);
+
+    int ocount = 0;
+    iomux_callbacks_t ocbs = {
+        .mux_output = test_output,
+        .priv = &ocount
+    };
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 0);
+    iomux_set_output_on_demand(mux, 1);
+    iomux_add(mux, sp[1], &ocbs);
+    iomux_run(mux, &tv);
+    iomux_run(mux, &tv);
+    ut_testing("on demand output: mux_output is not called unless wanted");
+    ut_validate_int(ocount, 0);
+    ut_testing("iomux_set_output_hint(mux, sp[1], 1024)");
+    ut_validate_int(iomux_set_output_hint(mux, sp[1], 1024), 1);
+    ut_testing("iomux_want_output(mux, sp[1])");
+    ut_validate_int(iomux_want_output(mux, sp[1]), 1);
+    iomux_loop(mux, &tv);
+    iomux_run(mux, &tv);
+    ut_testing("on demand output: mux_output is called once when writable");
+    if (ocount == 1 && read(sp[0], budgetbuf, 4) == 4)
+        ut_validate_buffer(budgetbuf, 4, "CIAO", 4);
+    else
+        ut_failure("mux_output called %d times", ocount);
+    ut_testing("mux_output receives the writable space hint");
+    ut_validate_int(output_hint, 1024);
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 0);
+    iomux_add(mux, sp[1], &ocbs);
+    ut_testing("iomux_set_output_hint(mux, sp[1], IOMUX_OUTPUT_HINT_KERNEL)");
+    ut_validate_int(iomux_set_output_hint(mux, sp[1], IOMUX_OUTPUT_HINT_KERNEL), 1);
+    // fill up the send buffer (the fd is non-blocking once added)
+    while (write(sp[1], bulk, sizeof(bulk)) > 0)
+        ;
+    ocount = 0;
+    iomux_run(mux, &tv);
+    ut_testing("kernel output hint: mux_output is not called while the send buffer is full");
+    ut_validate_int(ocount, 0);
+    while (recv(sp[0], budgetbuf, sizeof(budgetbuf), MSG_DONTWAIT) > 0)
+        ;
+    output_hint = 0;
+    iomux_run(mux, &tv);
+    ut_testing("kernel output hint: mux_output receives the free space of the send buffer");
+    if (ocount == 1 && output_hint > 0)
+        ut_success();
+    else
+        ut_failure("mux_output called %d times with a %d bytes hint", ocount, output_hint);
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    int acount = 0;
+    iomux_callbacks_t acbs = {
+        .mux_accept = test_accept,
+        .priv = &acount
+    };
+    int aserver = open_socket("localhost", TEST_SERVER_PORT + 1);
+    mux = iomux_create(0, 0);
+    iomux_add(mux, aserver, &acbs);
+    iomux_listen(mux, aserver);
+    ut_testing("iomux_set_accept_callbacks(mux, aserver, &pcbs)");
+    ut_validate_int(iomux_set_accept_callbacks(mux, aserver, &pcbs), 1);
+    iomux_set_accept_budget(mux, 1);
+    int aclient1 = open_connection("localhost", TEST_SERVER_PORT + 1, 5);
+    int aclient2 = open_connection("localhost", TEST_SERVER_PORT + 1, 5);
+    iomux_run(mux, &tv);
+    ut_testing("accept budget: one connection accepted per runcycle");
+    ut_validate_int(acount, 1);
+    iomux_run(mux, &tv);
+    ut_testing("accept budget: pending connections are accepted at the next runcycle");
+    ut_validate_int(acount, 2);
+    pcount = 0;
+    if (write(aclient1, "CIAO", 4) != 4) {
+        printf("Can't write to the client connection: %s\n", strerror(errno));
+        exit(-1);
+    }
+    iomux_loop(mux, &tv);
+    ut_testing("accepted connections use the callbacks of the listener template");
+    ut_validate_int(pcount, 1);
+    iomux_destroy(mux);
+    close(aclient1);
+    close(aclient2);
+    close(aserver);
+
+    // two muxes sharing the same listener (as in a pre-fork model)
+    acount = 0;
+    acbs.mux_accept = NULL;
+    acbs.mux_connection = test_group_connection;
+    aserver = open_socket("localhost", TEST_SERVER_PORT + 3);
+    mux = iomux_create(0, 0);
+    mux2 = iomux_create(0, 0);
+    iomux_add(mux, aserver, &acbs);
+    iomux_add(mux2, aserver, &acbs);
+    ut_testing("iomux_listen_exclusive(mux, aserver)");
+    ut_validate_int(iomux_listen_exclusive(mux, aserver), 1);
+    ut_testing("iomux_listen_exclusive(mux2, aserver)");
+    ut_validate_int(iomux_listen_exclusive(mux2, aserver), 1);
+#ifndef NO_PTHREAD
+    // both muxes are waiting on the listener when the connection comes in
+    pthread_t accept_th[2];
+    pthread_create(&accept_th[0], NULL, test_accept_thread, mux);
+    pthread_create(&accept_th[1], NULL, test_accept_thread, mux2);
+    usleep(100000);
+    aclient1 = open_connection("localhost", TEST_SERVER_PORT + 3, 5);
+    pthread_join(accept_th[0], NULL);
+    pthread_join(accept_th[1], NULL);
+#else
+    aclient1 = open_connection("localhost", TEST_SERVER_PORT + 3, 5);
+    iomux_run(mux, &tv);
+    iomux_run(mux2, &tv);
+#endif
+    uint64_t accepted = 0, accepted2 = 0, empty = 0, empty2 = 0;
+    iomux_accept_stats(mux, &accepted, &empty);
+    iomux_accept_stats(mux2, &accepted2, &empty2);
+    ut_testing("shared listener: the connection is accepted by a single mux");
+    if (acount == 1 && accepted + accepted2 == 1)
+        ut_success();
+    else
+        ut_failure("accepted %d connections (%d/%d)", acount, (int)accepted, (int)accepted2);
+    ut_testing("shared listener: the other mux is not woken up");
+    ut_validate_int((int)(empty + empty2), 0);
+    iomux_destroy(mux);
+    iomux_destroy(mux2);
+    close(aclient1);
+    close(aserver);
+
 #ifndef NO_PTHREAD
 
     int count = 0;
@@ -430,6 +1465,293 @@ main(int argc, char **argv)
     close(pfd[1]);
     close(server);
     close(client2);
+
+    int gcount = 0;
+    iomux_callbacks_t gcbs = {
+        .mux_connection = test_group_connection,
+        .priv = &gcount
+    };
+    ut_testing("iomux_group_create(2, 0)");
+    iomux_group_t *group = iomux_group_create(2, 0);
+    if (group && iomux_group_size(group) == 2)
+        ut_success();
+    else
+        ut_failure("Can't create the group");
+    struct sockaddr_in gaddr;
+    memset(&gaddr, 0, sizeof(gaddr));
+    gaddr.sin_family = AF_INET;
+    gaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    gaddr.sin_port = htons(TEST_SERVER_PORT + 2);
+    gcbs.mux_eof = test_group_eof;
+    ut_testing("iomux_group_listen(group, 127.0.0.1:%d)", TEST_SERVER_PORT + 2);
+    ut_validate_int(iomux_group_listen(group, (struct sockaddr *)&gaddr, sizeof(gaddr), &gcbs), 1);
+    iomux_loop_next_cb(iomux_group_get(group, 0), test_group_loop_next, NULL);
+    iomux_loop_end_cb(iomux_group_get(group, 0), test_group_loop_end, NULL);
+    ut_testing("iomux_group_start(group)");
+    ut_validate_int(iomux_group_start(group), 1);
+    int gclients[8];
+    for (i = 0; i < 8; i++)
+        gclients[i] = open_connection("localhost", TEST_SERVER_PORT + 2, 5);
+    for (i = 0; i < 100 && __sync_fetch_and_add(&gcount, 0) < 8; i++)
+        usleep(10000);
+    ut_testing("iomux group: connections accepted by the group loops");
+    ut_validate_int(gcount, 8);
+    iomux_group_end_loop(group);
+    ut_testing("iomux group: the loop_next callback is called at each runcycle");
+    ut_validate_int(group_loop_next > 0, 1);
+    ut_testing("iomux group: the loop_end callback is called when the group ends");
+    ut_validate_int(group_loop_end, 1);
+    iomux_group_destroy(group);
+    ut_testing("iomux_group_destroy(): mux_eof is not called for the listening sockets");
+    ut_validate_int(group_listener_eof, 0);
+    gcbs.mux_eof = NULL;
+    for (i = 0; i < 8; i++)
+        close(gclients[i]);
+
+    gcount = 0;
+    gcbs.mux_connection = test_group_cpu;
+    group = iomux_group_create(0, 0);
+    ut_testing("iomux_group_set_affinity(group, 1)");
+    ut_validate_int(iomux_group_set_affinity(group, 1), 1);
+    gaddr.sin_port = htons(TEST_SERVER_PORT + 4);
+    ut_testing("iomux_group_listen(group, 127.0.0.1:%d) with the reuseport cpu filter", TEST_SERVER_PORT + 4);
+    ut_validate_int(iomux_group_listen(group, (struct sockaddr *)&gaddr, sizeof(gaddr), &gcbs), 1);
+    iomux_group_start(group);
+    gclients[0] = open_connection("localhost", TEST_SERVER_PORT + 4, 5);
+    for (i = 0; i < 100 && __sync_fetch_and_add(&gcount, 0) < 1; i++)
+        usleep(10000);
+    ut_testing("iomux_incoming_cpu() on the accepted connection");
+    if (gcount == 1 && incoming_cpu >= 0)
+        ut_success();
+    else
+        ut_failure("accepted %d connections, incoming cpu %d", gcount, incoming_cpu);
+    ut_testing("reuseport cpu filter: the connection is accepted on the cpu which received it");
+    ut_validate_int(accepting_cpu, incoming_cpu);
+    iomux_group_destroy(group);
+    close(gclients[0]);
+
+    mux = iomux_create(0, 0);
+    int posts[3] = { 1, 2, 3 };
+    for (i = 0; i < 3; i++)
+        iomux_post(mux, test_post, &posts[i]);
+    iomux_run(mux, &tv);
+    ut_testing("iomux_post(): posted callbacks run in order");
+    ut_validate_int(posted_order, 123);
+    struct timeval post_tv = { 5, 0 };
+    struct timeval post_start, post_end;
+    pthread_t post_th;
+    gettimeofday(&post_start, NULL);
+    pthread_create(&post_th, NULL, test_post_thread, mux);
+    iomux_loop(mux, &post_tv);
+    gettimeofday(&post_end, NULL);
+    pthread_join(post_th, NULL);
+    ut_testing("iomux_post(): a waiting mux is woken up by another thread");
+    ut_validate_int(post_end.tv_sec - post_start.tv_sec < 2, 1);
+    iomux_destroy(mux);
+
+    int sp2[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, sp2) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    busy_context_t busy = { NULL, sp2[0], 0, -1, 0, 0, 0, 0 };
+    iomux_callbacks_t slow_cbs = {
+        .mux_input = test_slow_input,
+        .priv = &busy
+    };
+    mux = iomux_create(0, 1);
+    busy.mux = mux;
+    iomux_add(mux, sp[0], &slow_cbs);
+    iomux_add(mux, sp2[0], &pcbs);
+    if (write(sp[1], "CIAO", 4) != 4) {
+        printf("Can't write to the socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    pthread_create(&post_th, NULL, test_busy_writer, &busy);
+    iomux_run(mux, &tv);
+    pthread_join(post_th, NULL);
+    ut_testing("busy mux: iomux_write() and iomux_schedule() don't wait for the running callback");
+    if (busy.write_rc == 4 && busy.unknown_rc == 0 && busy.timer && busy.done_in_callback)
+        ut_success();
+    else
+        ut_failure("write returned %d (%d for an unknown fd), %s while the callback was running",
+                   busy.write_rc, busy.unknown_rc, busy.done_in_callback ? "done" : "not done");
+    iomux_run(mux, &tv);
+    iomux_run(mux, &tv);
+    ut_testing("busy mux: the data written meanwhile is sent by the loop");
+    memset(copybuf, 0, sizeof(copybuf));
+    if (recv(sp2[1], copybuf, 4, MSG_DONTWAIT) == 4)
+        ut_validate_buffer(copybuf, 4, "CIAO", 4);
+    else
+        ut_failure("Can't read the output: %s", strerror(errno));
+    iomux_destroy(mux);
+
+    mux = iomux_create(0, 1);
+    struct timeval slow_timer_tv = { 0, 1000 };
+    iomux_timeout_id_t slow_timer = iomux_schedule(mux, &slow_timer_tv, test_slow_timer, NULL, NULL);
+    pthread_create(&post_th, NULL, test_timer_thread, mux);
+    for (i = 0; i < 200 && !__sync_fetch_and_add(&slow_timer_running, 0); i++)
+        usleep(10000);
+    int unschedule_rc = iomux_unschedule(mux, slow_timer);
+    int done_on_return = __sync_fetch_and_add(&slow_timer_done, 0);
+    pthread_join(post_th, NULL);
+    ut_testing("iomux_unschedule() waits for the timer firing on another thread");
+    if (slow_timer_running && !unschedule_rc && done_on_return)
+        ut_success();
+    else
+        ut_failure("unschedule returned %d, timer %s", unschedule_rc, done_on_return ? "done" : "still running");
+    iomux_destroy(mux);
+
+    mux = iomux_create(0, 1);
+    mux2 = iomux_create(0, 1);
+    iomux_add(mux, sp[0], &pcbs);
+    iomux_add(mux2, sp2[0], &pcbs);
+    mover_context_t movers[2] = { { mux, mux2, sp[0], 0, 0 }, { mux2, mux, sp2[0], 0, 0 } };
+    pthread_t mover_th[2];
+    pthread_create(&mover_th[0], NULL, test_mover_thread, mux);
+    pthread_create(&mover_th[1], NULL, test_mover_thread, mux2);
+    iomux_post(mux, test_mover, &movers[0]);
+    iomux_post(mux2, test_mover, &movers[1]);
+    for (i = 0; i < 500 && !(__sync_fetch_and_add(&movers[0].done, 0) && __sync_fetch_and_add(&movers[1].done, 0)); i++)
+        usleep(10000);
+    ut_testing("iomux_move_fd(): moving fds both ways from callbacks on two threads doesn't deadlock");
+    if (movers[0].done && movers[1].done) {
+        __sync_add_and_fetch(&mover_leave, 1);
+        pthread_join(mover_th[0], NULL);
+        pthread_join(mover_th[1], NULL);
+        // attach the connections moved last
+        iomux_run(mux, &tv);
+        iomux_run(mux2, &tv);
+        if (movers[0].moves == 1000 && movers[1].moves == 1000 &&
+            iomux_callbacks(mux, sp[0]) && iomux_callbacks(mux2, sp2[0]) &&
+            iomux_num_fds(mux) == 1 && iomux_num_fds(mux2) == 1)
+        {
+            ut_success();
+        } else {
+            ut_failure("%d and %d moves, %d and %d fds", movers[0].moves, movers[1].moves,
+                       iomux_num_fds(mux), iomux_num_fds(mux2));
+        }
+        iomux_destroy(mux);
+        iomux_destroy(mux2);
+    } else {
+        // the loops are stuck, leave them alone
+        ut_failure("%d and %d moves done", movers[0].moves, movers[1].moves);
+    }
+    close(sp[0]);
+    close(sp[1]);
+    close(sp2[0]);
+    close(sp2[1]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    mux = iomux_create(0, 1);
+    iomux_add(mux, sp[0], &pcbs);
+    async_context_t async = { mux, iomux_connection_id(mux, sp[0]), 0 };
+    pthread_create(&post_th, NULL, test_async_writer, &async);
+    iomux_loop(mux, &post_tv);
+    pthread_join(post_th, NULL);
+    iomux_run(mux, &tv);
+    iomux_run(mux, &tv);
+    char asyncbuf[512];
+    int async_len = 0;
+    while (async_len < sizeof(asyncbuf) &&
+           (rb = recv(sp[1], asyncbuf + async_len, sizeof(asyncbuf) - async_len, MSG_DONTWAIT)) > 0)
+    {
+        async_len += rb;
+    }
+    for (i = 0; i < async_len && asyncbuf[i] == "CIAO"[i % 4]; i++)
+        ;
+    ut_testing("iomux_write_async() from another thread: the data is written in order");
+    if (async.written == 400 && async_len == 400 && i == 400)
+        ut_success();
+    else
+        ut_failure("%d bytes handed over, %d received (%d in order)", async.written, async_len, i);
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, sp2) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    iomux_callbacks_t oneshot_cbs = {
+        .mux_input = test_oneshot_input
+    };
+    mux = iomux_create(0, 1);
+    oneshot_slow_fd = sp[0];
+    iomux_add(mux, sp[0], &oneshot_cbs);
+    iomux_add(mux, sp2[0], &oneshot_cbs);
+    // oneshot dispatch is available only with epoll
+    if (iomux_set_oneshot(mux, 1)) {
+        pthread_t oneshot_th[2];
+        for (i = 0; i < 2; i++)
+            pthread_create(&oneshot_th[i], NULL, test_oneshot_thread, mux);
+        if (write(sp[1], "CIAO", 4) != 4) {
+            printf("Can't write to the socketpair: %s\n", strerror(errno));
+            exit(-1);
+        }
+        // let a thread enter the slow callback
+        for (i = 0; i < 300 && !__sync_fetch_and_add(&oneshot_active, 0); i++)
+            usleep(10000);
+        // more input for the busy connection and some for another one
+        if (write(sp[1], "CIAO", 4) != 4 || write(sp2[1], "CIAO", 4) != 4) {
+            printf("Can't write to the socketpair: %s\n", strerror(errno));
+            exit(-1);
+        }
+        for (i = 0; i < 300 && __sync_fetch_and_add(&oneshot_slow_calls, 0) < 2; i++)
+            usleep(10000);
+        __sync_add_and_fetch(&oneshot_leave, 1);
+        for (i = 0; i < 2; i++)
+            pthread_join(oneshot_th[i], NULL);
+        ut_testing("iomux_set_oneshot(): a slow callback doesn't stall the other connections");
+        if (oneshot_fast_calls == 1 && oneshot_fast_during_slow)
+            ut_success();
+        else
+            ut_failure("input on the other connection has been delivered after the slow callback");
+        ut_testing("iomux_set_oneshot(): callbacks of a connection never run concurrently");
+        ut_validate_int(oneshot_overlap, 0);
+    }
+    iomux_destroy(mux);
+    close(sp[0]);
+    close(sp[1]);
+    close(sp2[0]);
+    close(sp2[1]);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) != 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, sp2) != 0) {
+        printf("Can't create socketpair: %s\n", strerror(errno));
+        exit(-1);
+    }
+    group = iomux_group_create(2, 0);
+    // work stealing is available only with epoll
+    if (iomux_group_set_work_stealing(group, 1)) {
+        iomux_callbacks_t stolen_cbs = {
+            .mux_input = test_stolen_input
+        };
+        // both the slow connections belong to the first loop
+        mux = iomux_group_get(group, 0);
+        iomux_add(mux, sp[0], &stolen_cbs);
+        iomux_add(mux, sp2[0], &stolen_cbs);
+        if (write(sp[1], "CIAO", 4) != 4 || write(sp2[1], "CIAO", 4) != 4) {
+            printf("Can't write to the socketpair: %s\n", strerror(errno));
+            exit(-1);
+        }
+        iomux_group_start(group);
+        for (i = 0; i < 300 && __sync_fetch_and_add(&stolen_done, 0) < 2; i++)
+            usleep(10000);
+        ut_testing("iomux_group_set_work_stealing(): the idle loop runs callbacks of the busy one");
+        if (stolen_done == 2 && !pthread_equal(stolen_threads[0], stolen_threads[1]))
+            ut_success();
+        else
+            ut_failure("%d callbacks done, %s", stolen_done,
+                       stolen_done == 2 ? "both by the same loop" : "the loops are stuck");
+    }
+    iomux_group_destroy(group);
+    close(sp[0]);
+    close(sp[1]);
+    close(sp2[0]);
+    close(sp2[1]);
 #endif
 
     ut_summary();